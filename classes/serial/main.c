@@ -14,7 +14,7 @@
 #include <malloc.h>
 #include <pthread.h>
 #include <errno.h>
-#include <mqueue.h>
+#include <limits.h>
 #include <glob.h>
 
 #include "types.h"
@@ -34,6 +34,9 @@
 
 #define RETRY_DELAY 5000
 
+/* No MODEM input change pending from watch thread */
+#define THR_FLAGS_NONE INT_MIN
+
 
 typedef struct {
 	hk_obj_t *obj;
@@ -54,8 +57,7 @@ typedef struct {
 	buf_t lbuf;
         pthread_t thr;
         int thr_ok;
-	mqd_t thr_mq;
-	sys_tag_t thr_mq_tag;
+	int thr_flags;
         int io_only;
 	int debounce_delay;
         int debounce_flags;
@@ -64,6 +66,7 @@ typedef struct {
 
 static int tty_retry_cb(ctx_t *ctx);
 static int tty_connect(ctx_t *ctx);
+static int tty_thread_recv(ctx_t *ctx);
 
 
 static void timeout_clear(ctx_t *ctx)
@@ -100,6 +103,9 @@ static void tty_close(ctx_t *ctx)
                 ctx->thr_ok = 0;
         }
 
+        /* Discard MODEM input change posted by the thread before it was canceled */
+        __atomic_store_n(&ctx->thr_flags, THR_FLAGS_NONE, __ATOMIC_RELEASE);
+
         io_channel_close(&ctx->tty_chan);
 
         /* Update connection state pad */
@@ -197,11 +203,19 @@ static void *tty_thread(void *arg)
 
         int flags = 0;
         while (flags >= 0) {
+                int state;
+                int ret;
+
                 flags = serial_modem_wait(ctx->tty_chan.fd);
+                __atomic_store_n(&ctx->thr_flags, flags, __ATOMIC_RELEASE);
+
+                /* Do not cancel thread while posting (memory allocation) */
+                pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+                ret = sys_post((sys_func_t) tty_thread_recv, ctx);
+                pthread_setcancelstate(state, NULL);
 
-                char mbuf = flags & 0xFF;
-                if (mq_send(ctx->thr_mq, &mbuf, sizeof(mbuf), 0) < 0) {
-                        log_str("PANIC: %s: Cannot send message: %s", ctx->obj->name, strerror(errno));
+                if (ret < 0) {
+                        log_str("PANIC: %s: Cannot post MODEM input change", ctx->obj->name);
                         break;
                 }
         }
@@ -214,24 +228,22 @@ static void *tty_thread(void *arg)
 }
 
 
-static int tty_thread_recv(ctx_t *ctx, int fd)
+static int tty_thread_recv(ctx_t *ctx)
 {
-	char mbuf;
-	ssize_t msize = mq_receive(ctx->thr_mq, &mbuf, sizeof(mbuf), NULL);
-	if (msize < 0) {
-		if ((errno != EAGAIN) && (errno != EINTR)) {
-			log_str("PANIC: %s: Cannot handle thread message: %s", ctx->obj->name, strerror(errno));
-		}
-		return 0;
-	}
+        /* Only the latest MODEM input state matters */
+        int flags = __atomic_exchange_n(&ctx->thr_flags, THR_FLAGS_NONE, __ATOMIC_ACQ_REL);
 
-	if (msize != 1) {
-		log_str("PANIC: %s: Received thread message with illegal size (%d)", ctx->obj->name, msize);
-		return 0;
-	}
+        if (flags == THR_FLAGS_NONE) {
+                return 0;
+        }
+
+        /* Ignore late post if serial device was closed in the meantime */
+        if (ctx->tty_chan.fd < 0) {
+                return 0;
+        }
 
         /* Hangup signal */
-        if (mbuf == 0xFF) {
+        if (flags < 0) {
                 log_str("PANIC: %s: Watch thread i/o error", ctx->obj->name);
 
                 /* Trigger hangup procedure if in i/o mode only */
@@ -244,50 +256,14 @@ static int tty_thread_recv(ctx_t *ctx, int fd)
         /* Normal data */
 	if (ctx->debounce_delay > 0) {
                 timeout_clear(ctx);
-                ctx->debounce_flags = mbuf;
+                ctx->debounce_flags = flags;
 		ctx->timeout_tag = sys_timeout(ctx->debounce_delay, (sys_func_t) tty_debounce_cb, ctx);
 	}
 	else {
-                tty_update_outputs(ctx, mbuf);
-        }
-
-	return 1;
-}
-
-
-static int tty_thread_init(ctx_t *ctx)
-{
-        /* Only one init required */
-        if (ctx->thr_mq_tag > 0) {
-                return 0;
-        }
-
-        /* Create private messaging queue */
-	char id[64];
-        snprintf(id, sizeof(id), "/hakit-%s", ctx->obj->name);
-
-        int flags = O_RDWR | O_CREAT | O_EXCL | O_NONBLOCK;
-
-        struct mq_attr attr = {
-                .mq_flags   = O_NONBLOCK,
-                .mq_maxmsg  = 8,
-                .mq_msgsize = 1,
-        };
-
-        ctx->thr_mq = mq_open(id, flags, 0600, &attr);
-        if (ctx->thr_mq == -1) {
-                log_str("ERROR: %s: Cannot create message queue: %s", ctx->obj->name, strerror(errno));
-                return -1;
+                tty_update_outputs(ctx, flags);
         }
 
-        mq_unlink(id);  // Hide message queue from other processes
-
-        /* Message queue receive callback */
-        ctx->thr_mq_tag = sys_io_watch(ctx->thr_mq, (sys_io_func_t) tty_thread_recv, ctx);
-
-        log_debug(1, "%s: Message queue initialized", ctx->obj->name);
-
-        return 0;
+	return 0;
 }
 
 
@@ -390,15 +366,13 @@ static int tty_connect(ctx_t *ctx)
         ctx->thr_ok = 0;
         if (hk_pad_is_connected(ctx->dsr) || hk_pad_is_connected(ctx->cts) || hk_pad_is_connected(ctx->cd) || hk_pad_is_connected(ctx->ri)) {
                 log_debug(1, "%s: Starting watch thread for Modem control signals", ctx->obj->name);
-                int ret = tty_thread_init(ctx);
-                if (ret == 0) {
-                        ret = pthread_create(&ctx->thr, NULL, tty_thread, ctx);
-                        if (ret < 0) {
-                                log_str("ERROR: %s, pthread_create: %s", ctx->obj->name, strerror(errno));
-                        }
-                        else {
-                                ctx->thr_ok = 1;
-                        }
+                ctx->thr_flags = THR_FLAGS_NONE;
+                int ret = pthread_create(&ctx->thr, NULL, tty_thread, ctx);
+                if (ret != 0) {
+                        log_str("ERROR: %s, pthread_create: %s", ctx->obj->name, strerror(ret));
+                }
+                else {
+                        ctx->thr_ok = 1;
                 }
         }
         else {
@@ -146,12 +146,7 @@ void buf_shift(buf_t *buf, int ofs)
 {
         if (ofs > 0) {
                 if (ofs < buf->len) {
-                        int i;
-
-                        for (i = ofs; i < buf->len; i++) {
-                                buf->base[i-ofs] = buf->base[i];
-                        }
-
+                        memmove(buf->base, buf->base + ofs, buf->len - ofs);
                         buf->len -= ofs;
                 }
                 else {
@@ -159,3 +154,63 @@ void buf_shift(buf_t *buf, int ofs)
                 }
         }
 }
+
+
+int buf_varint_size(unsigned long long v)
+{
+	int size = 1;
+
+	while (v >= 0x80) {
+		v >>= 7;
+		size++;
+	}
+
+	return size;
+}
+
+
+/* Returns the number of bytes written (10 at most) */
+int buf_put_varint(unsigned char *ptr, unsigned long long v)
+{
+	int len = 0;
+
+	while (v >= 0x80) {
+		ptr[len++] = (v & 0x7F) | 0x80;
+		v >>= 7;
+	}
+	ptr[len++] = v;
+
+	return len;
+}
+
+
+int buf_append_varint(buf_t *buf, unsigned long long v)
+{
+	unsigned char str[10];
+	int len = buf_put_varint(str, v);
+
+	return buf_append(buf, str, len);
+}
+
+
+/* Returns the number of bytes consumed, 0 if incomplete, -1 if malformed */
+int buf_parse_varint(unsigned char *ptr, int len, unsigned long long *pv)
+{
+	unsigned long long v = 0;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (i >= 10) {
+			return -1;
+		}
+
+		v |= ((unsigned long long) (ptr[i] & 0x7F)) << (7*i);
+
+		if ((ptr[i] & 0x80) == 0) {
+			*pv = v;
+			return i+1;
+		}
+	}
+
+	return 0;
+}
@@ -54,16 +54,28 @@ static void comm_ws_send(ws_server_t *server, hk_ep_t *ep)
         char *tile_name = hk_ep_get_tile_name(ep);
         char *name = hk_ep_get_name(ep);
         char *value = hk_ep_get_value(ep);
-	int size = strlen(tile_name) + strlen(name) + strlen(value) + 24;
-        unsigned long long t = tstamp_ms();
+	int size = strlen(tile_name) + strlen(name) + strlen(value) + 56;
+        unsigned long long t = tstamp_us();
 	char str[size];
+	int len;
+
+	/* Prefix charted endpoint event with its trace sequence number,
+	   to let clients update their trace cursor.
+	   This is only done if this endpoint holds the last recorded point,
+	   i.e. the update was actually pushed to its trace (sinks connected
+	   to a local source are not traced) */
+        str[0] = '!';
+        len = 1;
+        if ((ep->chart != NULL) && (ep->tr.count > 0) && (ep->tr.seq == hk_trace_seq())) {
+                len += snprintf(str+len, size-len, "%llu,", ep->tr.seq);
+        }
 
 	/* Send WebSocket event */
         if (hk_tile_nmemb() > 1) {
-                snprintf(str, size, "!%llu,%s.%s=%s", t, tile_name, name, value);
+                snprintf(str+len, size-len, "%llu.%03llu,%s.%s=%s", t / 1000, t % 1000, tile_name, name, value);
         }
         else {
-                snprintf(str, size, "!%llu,%s=%s", t, name, value);
+                snprintf(str+len, size-len, "%llu.%03llu,%s=%s", t / 1000, t % 1000, name, value);
         }
 
 	ws_server_send_event(server, str);
@@ -118,11 +130,27 @@ typedef struct {
         buf_t *out_buf;
         uint64_t t1;
         uint64_t t2;
+        int max;
+        int points;
+        int resume;                // Incremental dump requested with a valid cursor
+        unsigned long long seq;    // Last point sequence number known by client
 } comm_command_ctx_t;
 
 static int comm_command_trace_dump(comm_command_ctx_t *ctx, hk_ep_t *ep)
 {
-        hk_trace_dump(&ep->tr, ctx->t1, ctx->t2, ctx->out_buf);
+        /* Send points following cursor, or full dump if some of them were lost */
+        if (ctx->resume) {
+                if (hk_trace_dump_since(&ep->tr, ctx->seq, ctx->out_buf) >= 0) {
+                        return 1;
+                }
+        }
+
+        if (ctx->points > 0) {
+                hk_trace_dump_sampled(&ep->tr, ctx->t1, ctx->t2, ctx->points, ctx->out_buf);
+        }
+        else {
+                hk_trace_dump(&ep->tr, ctx->t1, ctx->t2, ctx->max, ctx->out_buf);
+        }
         return 1;
 }
 
@@ -132,22 +160,46 @@ static int comm_command_trace(int argc, char **argv, buf_t *out_buf)
         char *name = NULL;
         uint64_t t1 = 0;
         uint64_t t2 = 0;
+        int max = 0;
+        int points = 0;
+        int cursor = 0;
+        int resume = 0;
+        unsigned long long seq = 0;
         int i;
 
-        if (argc > 3) {
+        if (argc > 5) {
                 goto USAGE;
         }
 
         for (i = 1; i < argc; i++) {
                 char *args = argv[i];
                 char *sep = strchr(args, ':');
-                if (sep != NULL) {
+                if (*args == '/') {
+                        points = strtol(args+1, NULL, 0);
+                }
+                else if (*args == '@') {
+                        /* Cursor is only valid for the engine instance that issued it,
+                           and cannot be ahead of the last recorded point.
+                           Otherwise, a regular dump is sent along with a new cursor */
+                        char *str = args+1;
+                        cursor = 1;
+                        if ((strtoull(str, &str, 0) == tstamp_t0()) && (*str == '.')) {
+                                seq = strtoull(str+1, NULL, 0);
+                                if (seq <= hk_trace_seq()) {
+                                        resume = 1;
+                                }
+                        }
+                }
+                else if (sep != NULL) {
                         *(sep++) = '\0';
                         if (*args != '\0') {
                                 t1 = strtoull(args, NULL, 0);
                         }
                         if (*sep != '\0') {
-                                t2 = strtoull(sep, NULL, 0);
+                                t2 = strtoull(sep, &sep, 0);
+                        }
+                        if (*sep == ':') {
+                                max = strtol(sep+1, NULL, 0);
                         }
                 }
                 else {
@@ -158,6 +210,16 @@ static int comm_command_trace(int argc, char **argv, buf_t *out_buf)
                 }
         }
 
+        comm_command_ctx_t ctx = {
+                .out_buf = out_buf,
+                .t1 = t1,
+                .t2 = t2,
+                .max = max,
+                .points = points,
+                .resume = resume,
+                .seq = seq,
+        };
+
         if (name != NULL) {
                 hk_ep_t *ep = HK_EP(hk_source_retrieve_by_name(name));
                 if (ep == NULL) {
@@ -168,25 +230,24 @@ static int comm_command_trace(int argc, char **argv, buf_t *out_buf)
                         }
                 }
 
-                hk_trace_dump(&ep->tr, t1, t2, out_buf);
+                comm_command_trace_dump(&ctx, ep);
         }
         else {
-                comm_command_ctx_t ctx = {
-                        .out_buf = out_buf,
-                        .t1 = t1,
-                        .t2 = t2,
-                };
-
                 hk_source_foreach((hk_ep_foreach_func_t) comm_command_trace_dump, &ctx);
                 hk_sink_foreach((hk_ep_foreach_func_t) comm_command_trace_dump, &ctx);
         }
 
+        /* Give client the cursor for next incremental dump */
+        if (cursor) {
+                buf_append_fmt(out_buf, "@%llu.%llu\n", tstamp_t0(), hk_trace_seq());
+        }
+
 	buf_append_str(out_buf, ".\n");
 
         return 0;
 
 USAGE:
-        log_str("ERROR: Usage: %s [<endpoint>] [[<t1>]:[<t2>]]", argv[0]);
+        log_str("ERROR: Usage: %s [<endpoint>] [[<t1>]:[<t2>][:<max>]] [/<points>] [@[<cursor>]]", argv[0]);
         return -1;
 }
 
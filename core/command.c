@@ -13,9 +13,27 @@
 
 #include "log.h"
 #include "str_argv.h"
+#include "line.h"
 #include "command.h"
 
 
+static void command_recv_line(command_t *cmd, char *str, int len)
+{
+	log_debug(2, "command_recv: '%s'", str);
+
+	if (cmd->handler != NULL) {
+		char **argv = NULL;
+		int argc = str_argv(str, &argv);
+
+		cmd->handler(cmd->user_data, argc, argv);
+
+		if (argv != NULL) {
+			free(argv);
+		}
+	}
+}
+
+
 int command_recv(command_t *cmd, char *buf, int len)
 {
 	int ret = 1;
@@ -27,34 +45,7 @@ int command_recv(command_t *cmd, char *buf, int len)
 		ret = 0;
 	}
 	else {
-		int i = 0;
-
-		while (i < len) {
-			int i0 = i;
-
-			while ((i < len) && (buf[i] != '\n')) {
-				i++;
-			}
-
-			buf_append(&cmd->line, (unsigned char *) &buf[i0], i-i0);
-
-			if (i < len) {
-				log_debug(2, "command_recv: '%s'", cmd->line.base);
-				if ((cmd->handler != NULL) && (cmd->line.len > 0)) {
-					char **argv = NULL;
-					int argc = str_argv((char *) cmd->line.base, &argv);
-
-					cmd->handler(cmd->user_data, argc, argv);
-
-					if (argv != NULL) {
-						free(argv);
-					}
-				}
-
-				cmd->line.len = 0;
-				i++;
-			}
-		}
+		line_split(&cmd->line, buf, len, (line_func_t) command_recv_line, cmd);
 	}
 
 	return ret;
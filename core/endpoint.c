@@ -14,6 +14,7 @@
 #include <malloc.h>
 
 #include "tab.h"
+#include "hash.h"
 #include "log.h"
 #include "mod.h"
 #include "endpoint.h"
@@ -33,6 +34,8 @@ static hk_source_t *hk_source_retrieve_by_full_name(char *tile_name, char *name)
 typedef struct {
 	hk_tab_t sinks;       // Table of (hk_sink_t *)
 	hk_tab_t sources;     // Table of (hk_source_t *)
+	hk_hash_t sinks_index;    // Sinks indexed by name
+	hk_hash_t sources_index;  // Sources indexed by name
         int trace_depth;
 } hk_endpoints_t;
 
@@ -44,15 +47,19 @@ int hk_endpoints_init(void)
 	memset(&hk_endpoints, 0, sizeof(hk_endpoints));
 	hk_tab_init(&hk_endpoints.sinks, sizeof(hk_sink_t *));
 	hk_tab_init(&hk_endpoints.sources, sizeof(hk_source_t *));
+	hk_hash_init(&hk_endpoints.sinks_index);
+	hk_hash_init(&hk_endpoints.sources_index);
 	return 0;
 }
 
 
 void hk_endpoints_shutdown(void)
 {
+	hk_hash_cleanup(&hk_endpoints.sinks_index);
         hk_sink_foreach((hk_ep_foreach_func_t) hk_sink_free, NULL);
 	hk_tab_cleanup(&hk_endpoints.sinks);
 
+	hk_hash_cleanup(&hk_endpoints.sources_index);
         hk_source_foreach((hk_ep_foreach_func_t) hk_source_free, NULL);
 	hk_tab_cleanup(&hk_endpoints.sources);
 }
@@ -220,20 +227,16 @@ static void hk_ep_cleanup(hk_ep_t *ep)
 
 static hk_sink_t *hk_sink_retrieve_by_full_name(char *tile_name, char *name)
 {
-	int i;
+	hk_hash_entry_t *entry = hk_hash_first(&hk_endpoints.sinks_index, name);
 
-	for (i = 0; i < hk_endpoints.sinks.nmemb; i++) {
-		hk_sink_t *sink = HK_TAB_VALUE(hk_endpoints.sinks, hk_sink_t *, i);
-                if (sink != NULL) {
-                        hk_obj_t *obj = sink->ep.obj;
-                        if ((obj != NULL) && (obj->name != NULL)) {
-                                if ((tile_name == NULL) || (strcmp(obj->tile->name, tile_name) == 0)) {
-                                        if (strcmp(obj->name, name) == 0) {
-                                                return sink;
-                                        }
-                                }
-                        }
+	/* Endpoints with the same name may exist in different tiles */
+	while (entry != NULL) {
+		hk_sink_t *sink = entry->value;
+                hk_obj_t *obj = sink->ep.obj;
+                if ((obj != NULL) && ((tile_name == NULL) || (strcmp(obj->tile->name, tile_name) == 0))) {
+                        return sink;
                 }
+		entry = hk_hash_next(entry);
 	}
 
 	return NULL;
@@ -265,23 +268,19 @@ hk_sink_t *hk_sink_retrieve_by_name(char *name)
 
 static hk_sink_t *hk_sink_alloc(hk_obj_t *obj, int local)
 {
-	hk_sink_t *sink = NULL;
+	hk_sink_t *sink;
 	int i;
 
-        /* Search a free entry in the sink table */
-	for (i = 0; (i < hk_endpoints.sinks.nmemb) && (sink == NULL); i++) {
-		sink = HK_TAB_VALUE(hk_endpoints.sinks, hk_sink_t *, i);
-		if (sink->ep.obj != NULL) {
-                        sink = NULL;
-		}
-	}
+        /* Get a free entry in the sink table */
+	i = hk_tab_alloc(&hk_endpoints.sinks);
+	hk_sink_t **psink = HK_TAB_PTR(hk_endpoints.sinks, hk_sink_t *, i);
 
-        /* If no free entry found, create a new one */
-        if (sink == NULL) {
-                hk_sink_t **psink = hk_tab_push(&hk_endpoints.sinks);
-                *psink = sink = (hk_sink_t *) malloc(sizeof(hk_sink_t));
-                memset(sink, 0, sizeof(hk_sink_t));
+        /* If entry is new, create the sink descriptor */
+        if (*psink == NULL) {
+                *psink = (hk_sink_t *) malloc(sizeof(hk_sink_t));
+                memset(*psink, 0, sizeof(hk_sink_t));
         }
+        sink = *psink;
 
         hk_ep_init(&sink->ep, HK_EP_SINK, i, obj, hk_endpoints.trace_depth);
 
@@ -363,6 +362,7 @@ hk_sink_t *hk_sink_register(hk_obj_t *obj, int local)
 
 	/* Allocate new sink */
 	sink = hk_sink_alloc(obj, local);
+	hk_hash_insert(&hk_endpoints.sinks_index, obj->name, sink);
 	log_debug(2, "hk_sink_register '%s' #%d (%d elements)", obj->name, sink->ep.id, hk_endpoints.sinks.nmemb);
 
         /* Establish local connection with source, if any */
@@ -420,6 +420,23 @@ char *hk_sink_update(hk_sink_t *sink, char *value)
 }
 
 
+hk_sink_t *hk_sink_retrieve_by_id(int id)
+{
+	hk_sink_t *sink;
+
+	if ((id < 0) || (id >= hk_endpoints.sinks.nmemb)) {
+		return NULL;
+	}
+
+	sink = HK_TAB_VALUE(hk_endpoints.sinks, hk_sink_t *, id);
+	if ((sink == NULL) || (sink->ep.obj == NULL)) {
+		return NULL;
+	}
+
+	return sink;
+}
+
+
 void hk_sink_update_by_name(char *name, char *value)
 {
 	hk_sink_t *sink = hk_sink_retrieve_by_name(name);
@@ -486,20 +503,16 @@ int hk_source_to_advertise(void)
 
 static hk_source_t *hk_source_retrieve_by_full_name(char *tile_name, char *name)
 {
-	int i;
+	hk_hash_entry_t *entry = hk_hash_first(&hk_endpoints.sources_index, name);
 
-	for (i = 0; i < hk_endpoints.sources.nmemb; i++) {
-		hk_source_t *source = HK_TAB_VALUE(hk_endpoints.sources, hk_source_t *, i);
-                if (source != NULL) {
-                        hk_obj_t *obj = source->ep.obj;
-                        if ((obj != NULL) && (obj->name != NULL)) {
-                                if ((tile_name == NULL) || (strcmp(obj->tile->name, tile_name) == 0)) {
-                                        if (strcmp(obj->name, name) == 0) {
-                                                return source;
-                                        }
-                                }
-                        }
+	/* Endpoints with the same name may exist in different tiles */
+	while (entry != NULL) {
+		hk_source_t *source = entry->value;
+                hk_obj_t *obj = source->ep.obj;
+                if ((obj != NULL) && ((tile_name == NULL) || (strcmp(obj->tile->name, tile_name) == 0))) {
+                        return source;
                 }
+		entry = hk_hash_next(entry);
 	}
 
 	return NULL;
@@ -529,25 +542,38 @@ hk_source_t *hk_source_retrieve_by_name(char *name)
 }
 
 
+hk_source_t *hk_source_retrieve_by_id(int id)
+{
+	hk_source_t *source;
+
+	if ((id < 0) || (id >= hk_endpoints.sources.nmemb)) {
+		return NULL;
+	}
+
+	source = HK_TAB_VALUE(hk_endpoints.sources, hk_source_t *, id);
+	if ((source == NULL) || (source->ep.obj == NULL)) {
+		return NULL;
+	}
+
+	return source;
+}
+
+
 static hk_source_t *hk_source_alloc(hk_obj_t *obj, int local, int event)
 {
-	hk_source_t *source = NULL;
+	hk_source_t *source;
 	int i;
 
-        /* Search a free entry in the source table */
-	for (i = 0; (i < hk_endpoints.sources.nmemb) && (source == NULL); i++) {
-		source = HK_TAB_VALUE(hk_endpoints.sources, hk_source_t *, i);
-		if (source->ep.obj != NULL) {
-                        source = NULL;
-		}
-	}
+        /* Get a free entry in the source table */
+	i = hk_tab_alloc(&hk_endpoints.sources);
+	hk_source_t **psource = HK_TAB_PTR(hk_endpoints.sources, hk_source_t *, i);
 
-        /* If no free entry found, create a new one */
-        if (source == NULL) {
-                hk_source_t **psource = hk_tab_push(&hk_endpoints.sources);
-                *psource = source = (hk_source_t *) malloc(sizeof(hk_source_t));
-                memset(source, 0, sizeof(hk_source_t));
+        /* If entry is new, create the source descriptor */
+        if (*psource == NULL) {
+                *psource = (hk_source_t *) malloc(sizeof(hk_source_t));
+                memset(*psource, 0, sizeof(hk_source_t));
         }
+        source = *psource;
 
         hk_ep_init(&source->ep, HK_EP_SOURCE, i, obj, hk_endpoints.trace_depth);
 
@@ -560,6 +586,7 @@ static hk_source_t *hk_source_alloc(hk_obj_t *obj, int local, int event)
 	}
 
         hk_ep_set_widget(HK_EP(source), "led-red");
+        source->version = 1;
 
         /* Init locally resolved links */
 	hk_tab_init(&source->local_sinks, sizeof(hk_sink_t *));
@@ -601,6 +628,7 @@ hk_source_t *hk_source_register(hk_obj_t *obj, int local, int event)
 
 	/* Allocate new source */
 	source = hk_source_alloc(obj, local, event);
+	hk_hash_insert(&hk_endpoints.sources_index, obj->name, source);
 	log_debug(2, "hk_source_register '%s' #%d (%d elements)", obj->name, source->ep.id, hk_endpoints.sources.nmemb);
 
         /* Establish local connection with sink, if any */
@@ -674,6 +702,7 @@ char *hk_source_update(hk_source_t *source, char *value)
 
         /* Update value */
         buf_set_str(&source->ep.value, value);
+        source->version++;
 
         /* Record source update to trace */
         if (source->ep.chart != NULL) {
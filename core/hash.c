@@ -0,0 +1,151 @@
+/*
+ * HAKit - The Home Automation KIT - www.hakit.net
+ * Copyright (C) 2014 Sylvain Giroudon
+ *
+ * String-keyed hash tables
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+
+#include "hash.h"
+
+#define HK_HASH_MIN_BUCKETS 64
+
+
+/* FNV-1a string hash */
+unsigned int hk_hash_str(char *str)
+{
+	unsigned int hval = 2166136261U;
+
+	while (*str != '\0') {
+		hval ^= (unsigned char) *(str++);
+		hval *= 16777619U;
+	}
+
+	return hval;
+}
+
+
+void hk_hash_init(hk_hash_t *hash)
+{
+	hash->buckets = NULL;
+	hash->nbuckets = 0;
+	hash->nmemb = 0;
+}
+
+
+void hk_hash_cleanup(hk_hash_t *hash)
+{
+	int i;
+
+	for (i = 0; i < hash->nbuckets; i++) {
+		hk_hash_entry_t *entry = hash->buckets[i];
+		while (entry != NULL) {
+			hk_hash_entry_t *next = entry->next;
+			free(entry->key);
+			free(entry);
+			entry = next;
+		}
+	}
+
+	if (hash->buckets != NULL) {
+		free(hash->buckets);
+	}
+
+	hk_hash_init(hash);
+}
+
+
+static void hk_hash_append(hk_hash_entry_t **buckets, int nbuckets, hk_hash_entry_t *entry)
+{
+	hk_hash_entry_t **pnext = &buckets[entry->hval & (nbuckets - 1)];
+
+	/* Append entry at end of chain, to keep order of insertion */
+	while (*pnext != NULL) {
+		pnext = &(*pnext)->next;
+	}
+
+	entry->next = NULL;
+	*pnext = entry;
+}
+
+
+static void hk_hash_grow(hk_hash_t *hash)
+{
+	int nbuckets = hash->nbuckets ? (hash->nbuckets * 2) : HK_HASH_MIN_BUCKETS;
+	hk_hash_entry_t **buckets = calloc(nbuckets, sizeof(hk_hash_entry_t *));
+	int i;
+
+	for (i = 0; i < hash->nbuckets; i++) {
+		hk_hash_entry_t *entry = hash->buckets[i];
+		while (entry != NULL) {
+			hk_hash_entry_t *next = entry->next;
+			hk_hash_append(buckets, nbuckets, entry);
+			entry = next;
+		}
+	}
+
+	if (hash->buckets != NULL) {
+		free(hash->buckets);
+	}
+
+	hash->buckets = buckets;
+	hash->nbuckets = nbuckets;
+}
+
+
+void hk_hash_insert(hk_hash_t *hash, char *key, void *value)
+{
+	hk_hash_entry_t *entry;
+
+	/* Keep load factor below 1 */
+	if (hash->nmemb >= hash->nbuckets) {
+		hk_hash_grow(hash);
+	}
+
+	entry = malloc(sizeof(hk_hash_entry_t));
+	entry->hval = hk_hash_str(key);
+	entry->key = strdup(key);
+	entry->value = value;
+
+	hk_hash_append(hash->buckets, hash->nbuckets, entry);
+	hash->nmemb++;
+}
+
+
+static hk_hash_entry_t *hk_hash_lookup(hk_hash_entry_t *entry, unsigned int hval, char *key)
+{
+	while (entry != NULL) {
+		if ((entry->hval == hval) && (strcmp(entry->key, key) == 0)) {
+			return entry;
+		}
+		entry = entry->next;
+	}
+
+	return NULL;
+}
+
+
+hk_hash_entry_t *hk_hash_first(hk_hash_t *hash, char *key)
+{
+	unsigned int hval;
+
+	if (hash->nbuckets == 0) {
+		return NULL;
+	}
+
+	hval = hk_hash_str(key);
+	return hk_hash_lookup(hash->buckets[hval & (hash->nbuckets - 1)], hval, key);
+}
+
+
+hk_hash_entry_t *hk_hash_next(hk_hash_entry_t *entry)
+{
+	return hk_hash_lookup(entry->next, entry->hval, entry->key);
+}
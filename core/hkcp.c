@@ -10,12 +10,16 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <malloc.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include "log.h"
 #include "buf.h"
+#include "line.h"
+#include "tstamp.h"
 #include "iputils.h"
 #include "tcpio.h"
 #include "udpio.h"
@@ -24,74 +28,465 @@
 #include "hkcp_cmd.h"
 
 
+/* Slow peer management options */
+int opt_hkcp_lowat = -1;
+int opt_hkcp_hiwat = HKCP_HIWAT_DEFAULT;
+char *opt_hkcp_policy = NULL;
+int opt_hkcp_retries = HKCP_NODE_CONNECT_RETRIES;
+int opt_hkcp_retry_min = HKCP_NODE_RETRY_MIN;
+int opt_hkcp_retry_max = HKCP_NODE_RETRY_MAX;
+
+static const char *hkcp_policy_names[HKCP_POLICY_N] = {
+	"coalesce", "drop", "disconnect"
+};
+
+
 /* TCP Command context */
 typedef struct {
 	hkcp_t *hkcp;
 	tcp_sock_t *tcp_sock;
 	command_t *cmd;
 	int watch;
+	sys_tag_t close_tag;    // Deferred close of slow watch client
+	hkcp_backlog_t backlog;
+	int binary;             // Binary framing enabled
+	buf_t rbuf;             // Incomplete received frame
+	buf_t value;            // Received frame value
 } hkcp_command_ctx_t;
 
 
 /* Local functions forward declarations */
 static int hkcp_node_connect(hkcp_node_t *node);
+static int hkcp_node_retry_delay(hkcp_node_t *node);
+static int hkcp_node_connect_timeout(hkcp_node_t *node);
+static void hkcp_node_connect_failed(hkcp_node_t *node);
+static void hkcp_node_connected(hkcp_node_t *node);
 static void hkcp_node_remove(hkcp_node_t *node);
 
 static void hkcp_node_send_initial_value(hkcp_node_t *node, hk_source_t *source);
+static void hkcp_command_ctx_destroy(hkcp_command_ctx_t *ctx);
+static int hkcp_command_ctx_close(hkcp_command_ctx_t *ctx);
+static void hkcp_command_ctx_watch(hkcp_command_ctx_t *ctx, int watch);
 
 
 /*
- * Nodes
+ * Source bitmaps
  */
 
-static int hkcp_node_source_attached(hkcp_node_t *node, hk_source_t *source)
+static int hkcp_bitmap_test(hkcp_bitmap_t *bitmap, int id)
+{
+	if ((id >> 3) >= bitmap->size) {
+		return 0;
+	}
+
+	return (bitmap->bits[id >> 3] >> (id & 7)) & 1;
+}
+
+
+static void hkcp_bitmap_set(hkcp_bitmap_t *bitmap, int id)
+{
+	int i = id >> 3;
+
+	if (i >= bitmap->size) {
+		int size = bitmap->size ? bitmap->size : 8;
+
+		while (size <= i) {
+			size *= 2;
+		}
+
+		bitmap->bits = realloc(bitmap->bits, size);
+		memset(bitmap->bits + bitmap->size, 0, size - bitmap->size);
+		bitmap->size = size;
+	}
+
+	bitmap->bits[i] |= (1 << (id & 7));
+}
+
+
+static void hkcp_bitmap_reset(hkcp_bitmap_t *bitmap, int id)
+{
+	if ((id >> 3) < bitmap->size) {
+		bitmap->bits[id >> 3] &= ~(1 << (id & 7));
+	}
+}
+
+
+static void hkcp_bitmap_cleanup(hkcp_bitmap_t *bitmap)
+{
+	if (bitmap->bits != NULL) {
+		free(bitmap->bits);
+	}
+
+	bitmap->bits = NULL;
+	bitmap->size = 0;
+}
+
+
+/*
+ * Slow peer backlog
+ */
+
+typedef void (* hkcp_backlog_format_t)(void *user_data, hk_source_t *source, buf_t *out_buf);
+
+
+static void hkcp_backlog_init(hkcp_backlog_t *backlog)
+{
+	buf_init(&backlog->lines);
+	hk_tab_init(&backlog->sources, sizeof(hk_source_t *));
+	backlog->dirty.bits = NULL;
+	backlog->dirty.size = 0;
+	backlog->framed = 0;
+	backlog->dropped = 0;
+	backlog->coalesced = 0;
+}
+
+
+static void hkcp_backlog_clear(hkcp_backlog_t *backlog)
 {
-	int count = 0;
 	int i;
 
-	for (i = 0; i < node->sources.nmemb; i++) {
-		hk_source_t *source2 = HK_TAB_VALUE(node->sources, hk_source_t *, i);
-		if ((source2 != NULL) && ((source == NULL) || (source2 == source))) {
-			count++;
+	for (i = 0; i < backlog->sources.nmemb; i++) {
+		hk_source_t *source = HK_TAB_VALUE(backlog->sources, hk_source_t *, i);
+		hkcp_bitmap_reset(&backlog->dirty, source->ep.id);
+	}
+
+	backlog->lines.len = 0;
+	backlog->sources.nmemb = 0;
+}
+
+
+static void hkcp_backlog_cleanup(hkcp_backlog_t *backlog)
+{
+	buf_cleanup(&backlog->lines);
+	hk_tab_cleanup(&backlog->sources);
+	hkcp_bitmap_cleanup(&backlog->dirty);
+}
+
+
+/* Size of the oldest held back update */
+static int hkcp_backlog_first_size(hkcp_backlog_t *backlog)
+{
+	unsigned char *base = backlog->lines.base;
+	int len = backlog->lines.len;
+
+	if (backlog->framed) {
+		unsigned long long size;
+		int n = buf_parse_varint(base, len, &size);
+		if ((n > 0) && ((n + size) <= len)) {
+			return n + size;
+		}
+	}
+	else {
+		unsigned char *eol = memchr(base, '\n', len);
+		if (eol != NULL) {
+			return eol - base + 1;
 		}
 	}
 
-	return count;
+	return len;
 }
 
 
-static void hkcp_node_source_attach(hkcp_node_t *node, hk_source_t *source)
+static int hkcp_backlog_write(hkcp_t *hkcp, hkcp_backlog_t *backlog, tcp_sock_t *tcp_sock,
+			      hk_source_t *source, hkcp_backlog_format_t format, void *user_data)
 {
-	if (hkcp_node_source_attached(node, source)) {
-		return;
+	int congested = tcp_sock_is_congested(tcp_sock);
+
+	if (congested && (hkcp->policy == HKCP_POLICY_DISCONNECT)) {
+		return -1;
 	}
 
-	hk_source_t **psource = hk_tab_push(&node->sources);
-	*psource = source;
+	/* Non-event sources (and event sources on congested peer with coalesce policy):
+	   mark source as dirty, its latest value will be sent when the socket is writable */
+	if ((!hk_source_is_event(source)) || (congested && (hkcp->policy == HKCP_POLICY_COALESCE))) {
+		if (hkcp_bitmap_test(&backlog->dirty, source->ep.id)) {
+			backlog->coalesced++;
+			hkcp->coalesced++;
+			return 0;
+		}
 
-	log_debug(2, "hkcp_node_source_attach node=#%d='%s' source='%s.%s' (%d elements)", node->id, node->name, source->ep.obj->tile->name, source->ep.obj->name, node->sources.nmemb);
+		hkcp_bitmap_set(&backlog->dirty, source->ep.id);
+		HK_TAB_PUSH_VALUE(backlog->sources, source);
+		tcp_sock_request_drain(tcp_sock);
+
+		return 0;
+	}
+
+	/* Event sources: send all updates in order */
+	format(user_data, source, &backlog->lines);
+
+	/* Send immediately if peer is not congested */
+	if (!congested) {
+		tcp_sock_write(tcp_sock, (char *) backlog->lines.base, backlog->lines.len);
+		backlog->lines.len = 0;
+		return 0;
+	}
+
+	/* Drop oldest updates to keep backlog below high watermark */
+	while (backlog->lines.len > tcp_sock->hiwat) {
+		buf_shift(&backlog->lines, hkcp_backlog_first_size(backlog));
+		backlog->dropped++;
+		hkcp->dropped++;
+	}
+
+	return 0;
 }
 
 
-#if 0
-static void hkcp_node_source_detach(hkcp_node_t *node, hk_source_t *source)
+/* Send held back updates and latest values of dirty sources.
+   If batch is not NULL, dirty sources are gathered in a single command line
+   starting with this prefix */
+static void hkcp_backlog_flush(hkcp_backlog_t *backlog, tcp_sock_t *tcp_sock,
+			       hkcp_backlog_format_t format, void *user_data, char *batch)
 {
+	buf_t out_buf;
 	int i;
 
+	log_debug(2, "hkcp_backlog_flush [%d] lines=%d sources=%d", tcp_sock->chan.fd, backlog->lines.len, backlog->sources.nmemb);
+
+	buf_init(&out_buf);
+
+	buf_append(&out_buf, backlog->lines.base, backlog->lines.len);
+
+	if ((batch != NULL) && (backlog->sources.nmemb > 0)) {
+		buf_append_str(&out_buf, batch);
+	}
+
+	for (i = 0; i < backlog->sources.nmemb; i++) {
+		format(user_data, HK_TAB_VALUE(backlog->sources, hk_source_t *, i), &out_buf);
+	}
+
+	if ((batch != NULL) && (backlog->sources.nmemb > 0)) {
+		buf_append_str(&out_buf, "\n");
+	}
+
+	hkcp_backlog_clear(backlog);
+
+	if (out_buf.len > 0) {
+		tcp_sock_write(tcp_sock, (char *) out_buf.base, out_buf.len);
+	}
+
+	buf_cleanup(&out_buf);
+}
+
+
+/* Get integer value, if value string is the canonical form of a (not too large) integer */
+static int hkcp_value_int(char *value, long long *pv)
+{
+	char *s = value;
+	int len;
+
+	if (*s == '-') {
+		s++;
+	}
+
+	len = strlen(s);
+	if ((len == 0) || (len > 18)) {
+		return 0;
+	}
+	if ((s[0] == '0') && ((len > 1) || (s != value))) {
+		return 0;
+	}
+	if (strspn(s, "0123456789") != len) {
+		return 0;
+	}
+
+	*pv = strtoll(value, NULL, 10);
+
+	return 1;
+}
+
+
+/* Record value version sent to node */
+static void hkcp_node_sent(hkcp_node_t *node, hk_source_t *source)
+{
+	int id = source->ep.id;
+
+	while (node->versions.nmemb <= id) {
+		HK_TAB_PUSH_VALUE(node->versions, (unsigned long) 0);
+	}
+
+	HK_TAB_VALUE(node->versions, unsigned long, id) = source->version;
+}
+
+
+static void hkcp_format_frame(hkcp_node_t *node, hk_source_t *source, buf_t *out_buf)
+{
+	int sink_id = -1;
+	long long v;
+	int size;
+
+	if (source->ep.id < node->sink_ids.nmemb) {
+		sink_id = HK_TAB_VALUE(node->sink_ids, int, source->ep.id);
+	}
+
+	if (sink_id < 0) {
+		log_str("WARNING: Node #%d='%s': no sink id for source '%s'", node->id, node->name, source->ep.obj->name);
+		return;
+	}
+
+	hkcp_node_sent(node, source);
+
+	size = 1 + buf_varint_size(sink_id);
+
+	if (hkcp_value_int(hk_ep_get_value(HK_EP(source)), &v)) {
+		size += buf_varint_size(BUF_ZIGZAG(v));
+		buf_append_varint(out_buf, size);
+		buf_append_byte(out_buf, HKCP_FRAME_SET_INT);
+		buf_append_varint(out_buf, sink_id);
+		buf_append_varint(out_buf, BUF_ZIGZAG(v));
+	}
+	else {
+		size += source->ep.value.len;
+		buf_append_varint(out_buf, size);
+		buf_append_byte(out_buf, HKCP_FRAME_SET_STR);
+		buf_append_varint(out_buf, sink_id);
+		hk_ep_append_value(HK_EP(source), out_buf);
+	}
+}
+
+
+/* Append assignment ' name=value' of a 'set' command line */
+static void hkcp_format_assign(hkcp_node_t *node, hk_source_t *source, buf_t *out_buf)
+{
+	char *value = hk_ep_get_value(HK_EP(source));
+	char *s;
+
+	hkcp_node_sent(node, source);
+
+	buf_append_str(out_buf, " ");
+	buf_append_str(out_buf, source->ep.obj->name);
+	buf_append_str(out_buf, "=");
+
+	/* Quote value if it contains blanks or quoting characters,
+	   so that it does not merge with next assignments */
+	for (s = value; *s != '\0'; s++) {
+		if ((*s <= ' ') || (*s == '"') || (*s == '\\')) {
+			break;
+		}
+	}
+
+	if (*s == '\0') {
+		hk_ep_append_value(HK_EP(source), out_buf);
+	}
+	else {
+		buf_append_byte(out_buf, '"');
+		for (s = value; *s != '\0'; s++) {
+			if ((*s == '"') || (*s == '\\')) {
+				buf_append_byte(out_buf, '\\');
+			}
+			buf_append_byte(out_buf, *s);
+		}
+		buf_append_byte(out_buf, '"');
+	}
+}
+
+
+static void hkcp_format_set(hkcp_node_t *node, hk_source_t *source, buf_t *out_buf)
+{
+	if (node->binary) {
+		hkcp_format_frame(node, source, out_buf);
+		return;
+	}
+
+	buf_append_str(out_buf, "set");
+	hkcp_format_assign(node, source, out_buf);
+	buf_append_str(out_buf, "\n");
+}
+
+
+static void hkcp_node_flush(hkcp_node_t *node)
+{
+	if (node->binary) {
+		hkcp_backlog_flush(&node->backlog, &node->tcp_sock, (hkcp_backlog_format_t) hkcp_format_set, node, NULL);
+	}
+	else {
+		/* Gather latest values of all dirty sources in a single 'set' command */
+		hkcp_backlog_flush(&node->backlog, &node->tcp_sock, (hkcp_backlog_format_t) hkcp_format_assign, node, "set");
+	}
+}
+
+
+static void hkcp_format_watch(void *user_data, hk_source_t *source, buf_t *out_buf)
+{
+	buf_append_str(out_buf, "!");
+	hk_ep_append_name(HK_EP(source), out_buf);
+	buf_append_str(out_buf, "=");
+	hk_ep_append_value(HK_EP(source), out_buf);
+	buf_append_str(out_buf, "\n");
+}
+
+
+/*
+ * Nodes
+ */
+
+static int hkcp_node_source_attached(hkcp_node_t *node, hk_source_t *source)
+{
 	if (source == NULL) {
+		return node->nsources;
+	}
+
+	return hkcp_bitmap_test(&node->sources, source->ep.id);
+}
+
+
+static hk_tab_t *hkcp_subscribers(hkcp_t *hkcp, hk_source_t *source)
+{
+	if (source->ep.id >= hkcp->subscribers.nmemb) {
+		return NULL;
+	}
+
+	return HK_TAB_PTR(hkcp->subscribers, hk_tab_t, source->ep.id);
+}
+
+
+static void hkcp_node_source_attach(hkcp_node_t *node, hk_source_t *source)
+{
+	hkcp_t *hkcp = node->hkcp;
+	int id = source->ep.id;
+
+	if (hkcp_node_source_attached(node, source)) {
 		return;
 	}
 
-	log_debug(2, "hkcp_node_source_detach node=#%d='%s' source='%s'", node->id, node->name, source->ep.name);
+	hkcp_bitmap_set(&node->sources, id);
+	node->nsources++;
+
+	/* Add node to source subscribers */
+	while (hkcp->subscribers.nmemb <= id) {
+		hk_tab_init(hk_tab_push(&hkcp->subscribers), sizeof(hkcp_node_t *));
+	}
+	HK_TAB_PUSH_VALUE(*hkcp_subscribers(hkcp, source), node);
+
+	log_debug(2, "hkcp_node_source_attach node=#%d='%s' source='%s.%s' (%d elements)", node->id, node->name, source->ep.obj->tile->name, source->ep.obj->name, node->nsources);
+}
 
-	for (i = 0; i < node->sources.nmemb; i++) {
-		hk_source_t **psource = HK_TAB_PTR(node->sources, hk_source_t *, i);
-		if ((*psource != NULL) && ((source == NULL) ||(*psource == source))) {
-			*psource = NULL;
+
+static void hkcp_node_source_detach_all(hkcp_node_t *node)
+{
+	hkcp_t *hkcp = node->hkcp;
+	int id, i;
+
+	/* Remove node from all subscribers lists */
+	for (id = 0; (id < hkcp->subscribers.nmemb) && (node->nsources > 0); id++) {
+		if (hkcp_bitmap_test(&node->sources, id)) {
+			hk_tab_t *subscribers = HK_TAB_PTR(hkcp->subscribers, hk_tab_t, id);
+
+			for (i = 0; i < subscribers->nmemb; i++) {
+				if (HK_TAB_VALUE(*subscribers, hkcp_node_t *, i) == node) {
+					hk_tab_remove(subscribers, i);
+					break;
+				}
+			}
+
+			node->nsources--;
 		}
 	}
+
+	hkcp_bitmap_cleanup(&node->sources);
+	node->nsources = 0;
 }
-#endif
 
 
 static hkcp_node_t *hkcp_node_retrieve(hkcp_t *hkcp, char *name)
@@ -114,40 +509,28 @@ static hkcp_node_t *hkcp_node_retrieve(hkcp_t *hkcp, char *name)
 static hkcp_node_t *hkcp_node_alloc(hkcp_t *hkcp)
 {
 	hkcp_node_t *node;
-	hkcp_node_t **pnode = NULL;
+	hkcp_node_t **pnode;
 	int i;
 
 	/* Alloc node descriptor */
 	node = (hkcp_node_t *) malloc(sizeof(hkcp_node_t));
 	memset(node, 0, sizeof(hkcp_node_t));
 
-	/* Find entry in node table */
-	for (i = 0; i < hkcp->nodes.nmemb; i++) {
-		pnode = HK_TAB_PTR(hkcp->nodes, hkcp_node_t *, i);
-		if (*pnode == NULL) {
-			log_debug(2, "hkcp_node_alloc -> #%d (reused)", i);
-			break;
-		}
-	}
-
-	if (i >= hkcp->nodes.nmemb) {
-		log_debug(2, "hkcp_node_alloc -> #%d (new)", i);
-		pnode = hk_tab_push(&hkcp->nodes);
-	}
+	/* Get entry in node table */
+	i = hk_tab_alloc(&hkcp->nodes);
+	log_debug(2, "hkcp_node_alloc -> #%d", i);
 
-	if (pnode != NULL) {
-		*pnode = node;
-	}
-	else {
-		log_str("PANIC: node entry allocation failed");
-	}
+	pnode = HK_TAB_PTR(hkcp->nodes, hkcp_node_t *, i);
+	*pnode = node;
 
 	/* Init node entry */
 	node->id = i;
 	tcp_sock_clear(&node->tcp_sock);
 	node->hkcp = hkcp;
 	buf_init(&node->rbuf);
-	hk_tab_init(&node->sources, sizeof(hk_source_t *));
+	hkcp_backlog_init(&node->backlog);
+	hk_tab_init(&node->sink_ids, sizeof(int));
+	hk_tab_init(&node->versions, sizeof(unsigned long));
 
 	return node;
 }
@@ -161,6 +544,41 @@ static void hkcp_node_set_state(hkcp_node_t *node, hkcp_node_state_t state)
 }
 
 
+/* Send initial values of attached sources.
+   When resuming a session with the same peer instance, only send
+   values that changed since they were last sent, or that the peer did not get */
+static void hkcp_node_resync(hkcp_node_t *node, int resume)
+{
+	int nsent = 0;
+	int nskipped = 0;
+	int id;
+
+	for (id = 0; id < (node->sources.size << 3); id++) {
+		hk_source_t *source;
+
+		if (!hkcp_bitmap_test(&node->sources, id)) {
+			continue;
+		}
+
+		source = hk_source_retrieve_by_id(id);
+		if (source == NULL) {
+			continue;
+		}
+
+		if (resume && hkcp_bitmap_test(&node->synced, id) &&
+		    (id < node->versions.nmemb) && (HK_TAB_VALUE(node->versions, unsigned long, id) == source->version)) {
+			nskipped++;
+		}
+		else {
+			hkcp_node_send_initial_value(node, source);
+			nsent++;
+		}
+	}
+
+	log_debug(2, "hkcp_node_resync node=#%d='%s' resume=%d: %d sent, %d up to date", node->id, node->name, resume, nsent, nskipped);
+}
+
+
 static void hkcp_node_recv_sinks(hkcp_node_t *node, char *str)
 {
 	log_debug(2, "hkcp_node_recv_sinks node=#%d='%s' str='%s'", node->id, node->name, str);
@@ -168,17 +586,61 @@ static void hkcp_node_recv_sinks(hkcp_node_t *node, char *str)
 	if (*str == '.') {
 		/* If no sources attached to this node, remove it */
 		if (hkcp_node_source_attached(node, NULL) > 0) {
+			unsigned long long peer = 0;
+
+			/* Check whether node accepted binary framing, and get its instance id */
+			node->binary = 0;
+			if ((strncmp(str, ".binary", 7) == 0) && ((str[7] == '\0') || (str[7] == ' '))) {
+				node->binary = 1;
+				if (str[7] == ' ') {
+					peer = strtoull(str+8, NULL, 10);
+				}
+			}
+			node->backlog.framed = node->binary;
+			log_debug(2, "  binary=%d peer=%llu", node->binary, peer);
+
 			hkcp_node_set_state(node, HKCP_NODE_READY);
+			node->connect_attempts = 0;
+
+			/* Send initial values, resuming previous session if peer was not restarted */
+			hkcp_node_resync(node, (peer != 0) && (peer == node->peer));
+			node->peer = peer;
+			tcp_sock_request_drain(&node->tcp_sock);
 		}
 		else {
 			hkcp_node_remove(node);
 		}
 	}
 	else {
+		int sink_id = -1;
+		char *value = NULL;
+		int len = 0;
+
 		/* Mark sink name delimiter */
 		char *sp = strchr(str, ' ');
 		if (sp != NULL) {
 			*(sp++) = '\0';
+
+			/* Get sink id, if provided */
+			if (*sp == '@') {
+				sink_id = strtol(sp+1, NULL, 10);
+				sp = strchr(sp, ' ');
+				if (sp != NULL) {
+					sp++;
+				}
+			}
+
+			/* Get current sink value */
+			if ((sp != NULL) && (*sp == '"')) {
+				value = sp + 1;
+				len = strlen(value);
+				if ((len > 0) && (value[len-1] == '"')) {
+					len--;
+				}
+				else {
+					value = NULL;
+				}
+			}
 		}
 		
 		/* Check for local sources matching this remote sink */
@@ -192,8 +654,21 @@ static void hkcp_node_recv_sinks(hkcp_node_t *node, char *str)
 				/* Attach source to node (if not already done) */
 				hkcp_node_source_attach(node, source);
 
-				/* Send initial value */
-				hkcp_node_send_initial_value(node, source);
+				/* Record remote sink id for binary framing */
+				while (node->sink_ids.nmemb <= source->ep.id) {
+					HK_TAB_PUSH_VALUE(node->sink_ids, (int) -1);
+				}
+				HK_TAB_VALUE(node->sink_ids, int, source->ep.id) = sink_id;
+
+				/* Check whether peer already has the source value.
+				   Initial values are sent when the sinks list is complete */
+				if ((value != NULL) && (len == source->ep.value.len) &&
+				    (memcmp(value, source->ep.value.base, len) == 0)) {
+					hkcp_bitmap_set(&node->synced, source->ep.id);
+				}
+				else {
+					hkcp_bitmap_reset(&node->synced, source->ep.id);
+				}
 			}
 			else {
 				log_debug(2, "  remote sink='%s', matching source='%s.%s' (local)", str, source->ep.obj->tile->name, source->ep.obj->name);
@@ -206,7 +681,7 @@ static void hkcp_node_recv_sinks(hkcp_node_t *node, char *str)
 }
 
 
-static void hkcp_node_recv_line(hkcp_node_t *node, char *str)
+static void hkcp_node_recv_line(hkcp_node_t *node, char *str, int len)
 {
 	log_debug(3, "hkcp_node_recv_line node=#%d='%s' state=%d str='%s'", node->id, node->name, node->state, str);
 
@@ -222,45 +697,13 @@ static void hkcp_node_recv_line(hkcp_node_t *node, char *str)
 
 static void hkcp_node_recv(hkcp_node_t *node, char *rbuf, int rsize)
 {
-	int i;
-
 	log_debug(2, "hkcp_node_recv node=#%d='%s' rsize=%d", node->id, node->name, rsize);
 
 	if (rsize <= 0) {
 		return;
 	}
 
-	i = 0;
-	while (i < rsize) {
-		int i0 = i;
-
-		/* Search end-of-line delimiter */
-		while ((i < rsize) && (rbuf[i] != '\n')) {
-			i++;
-		}
-
-		// If newline character reached, process this line
-		if (i < rsize) {
-			char *str = &rbuf[i0];
-			int len = i - i0;
-
-			rbuf[i++] = '\0';
-
-			if (node->rbuf.len > 0) {
-				buf_append(&node->rbuf, (unsigned char *) str, len);
-				str = (char *) node->rbuf.base;
-				len = node->rbuf.len;
-				node->rbuf.len = 0;
-			}
-
-			if (len > 0) {
-				hkcp_node_recv_line(node, str);
-			}
-		}
-		else {
-			buf_append(&node->rbuf, (unsigned char *) &rbuf[i0], i-i0);
-		}	
-	}
+	line_split(&node->rbuf, rbuf, rsize, (line_func_t) hkcp_node_recv_line, node);
 }
 
 
@@ -272,7 +715,14 @@ static void hkcp_node_event(tcp_sock_t *tcp_sock, tcp_io_t io, char *rbuf, int r
 
 	switch (io) {
 	case TCP_IO_CONNECT:
-		log_debug(2, "  CONNECT %s", rbuf);
+		if (rbuf != NULL) {
+			log_debug(2, "  CONNECT %s", rbuf);
+			hkcp_node_connected(node);
+		}
+		else {
+			log_debug(2, "  CONNECT failed");
+			hkcp_node_connect_failed(node);
+		}
 		break;
 	case TCP_IO_DATA:
 		log_debug(2, "  DATA %d", rsize);
@@ -281,10 +731,23 @@ static void hkcp_node_event(tcp_sock_t *tcp_sock, tcp_io_t io, char *rbuf, int r
 	case TCP_IO_HUP:
 		log_debug(2, "  HUP");
 
-		/* Try to reconnect immediately */
+		/* Try to reconnect after a backoff delay.
+		   The jitter keeps nodes from reconnecting all at once when the peer
+		   goes away, and the attempts counter is only reset once a session
+		   reaches the ready state, so that a peer hanging up right after
+		   accepting connections is not retried in a tight loop */
+		hkcp_backlog_clear(&node->backlog);
 		hkcp_node_set_state(node, HKCP_NODE_IDLE);
-		node->connect_attempts = 0;
-		hkcp_node_connect(node);
+		if (node->timeout_tag == 0) {
+			node->timeout_tag = sys_timeout(hkcp_node_retry_delay(node), (sys_func_t) hkcp_node_connect, node);
+		}
+		break;
+	case TCP_IO_DRAIN:
+		log_debug(2, "  DRAIN");
+		/* Hold updates back until sinks handshake is complete */
+		if (node->state == HKCP_NODE_READY) {
+			hkcp_node_flush(node);
+		}
 		break;
 	default:
 		log_debug(2, "  PANIC: unknown event caught");
@@ -300,6 +763,7 @@ static void hkcp_node_remove(hkcp_node_t *node)
 	/* Free node entry for future use */
 	hkcp_node_t **pnode = HK_TAB_PTR(node->hkcp->nodes, hkcp_node_t *, node->id);
 	*pnode = NULL;
+	hk_tab_release(&node->hkcp->nodes, node->id);
 
 	/* Kill running timeout */
 	if (node->timeout_tag) {
@@ -307,8 +771,11 @@ static void hkcp_node_remove(hkcp_node_t *node)
 		node->timeout_tag = 0;
 	}
 
-	/* Clear table of sources */
-	hk_tab_cleanup(&node->sources);
+	/* Clear source subscriptions */
+	hkcp_node_source_detach_all(node);
+	hk_tab_cleanup(&node->sink_ids);
+	hk_tab_cleanup(&node->versions);
+	hkcp_bitmap_cleanup(&node->synced);
 
 	/* Shut down connection */
 	tcp_sock_set_data(&node->tcp_sock, NULL);
@@ -316,6 +783,7 @@ static void hkcp_node_remove(hkcp_node_t *node)
 
 	/* Clear data buffering */
 	buf_cleanup(&node->rbuf);
+	hkcp_backlog_cleanup(&node->backlog);
 
 	/* Free node name */
 	free(node->name);
@@ -326,41 +794,140 @@ static void hkcp_node_remove(hkcp_node_t *node)
 }
 
 
+/* Delay before next connection attempt: exponential backoff with jitter */
+static int hkcp_node_retry_delay(hkcp_node_t *node)
+{
+	hkcp_t *hkcp = node->hkcp;
+	int delay = hkcp->retry_min;
+	int i;
+
+	for (i = 1; (i < node->connect_attempts) && (delay < hkcp->retry_max); i++) {
+		delay *= 2;
+	}
+
+	if (delay > hkcp->retry_max) {
+		delay = hkcp->retry_max;
+	}
+
+	/* Pick a random delay in the upper half,
+	   so that nodes do not all retry at the same time */
+	return (delay / 2) + (rand_r(&hkcp->seed) % ((delay / 2) + 1));
+}
+
+
 static int hkcp_node_connect(hkcp_node_t *node)
 {
+	node->timeout_tag = 0;
 	node->connect_attempts++;
 	hkcp_node_set_state(node, HKCP_NODE_CONNECT);
 
-	log_str("Connecting to node #%d='%s' (%d/%d)", node->id, node->name, node->connect_attempts, HKCP_NODE_CONNECT_RETRIES);
-	if (tcp_sock_connect(&node->tcp_sock, node->name, node->hkcp->port, node->hkcp->certs, hkcp_node_event, node) > 0) {
-		node->timeout_tag = 0;
-		/* Get list of sinks from this node */
-		hkcp_node_set_state(node, HKCP_NODE_SINKS);
-		tcp_sock_write(&node->tcp_sock, "sinks\n", 6);
+	log_str("Connecting to node #%d='%s' (%d/%d)", node->id, node->name, node->connect_attempts, node->hkcp->retries);
+	node->connect_t0 = tstamp_ms();
+
+	if (tcp_sock_connect(&node->tcp_sock, node->name, node->hkcp->port, node->hkcp->certs, hkcp_node_event, node) < 0) {
+		hkcp_node_connect_failed(node);
 		return 0;
 	}
 
-	if (node->connect_attempts > HKCP_NODE_CONNECT_RETRIES) {
-		log_str("Too many connections attempted on node #%d='%s': giving up", node->id, node->name);
+	/* Give up this attempt if connection takes too long */
+	node->timeout_tag = sys_timeout(HKCP_NODE_CONNECT_TIMEOUT, (sys_func_t) hkcp_node_connect_timeout, node);
+
+	return 0;
+}
+
+
+static int hkcp_node_connect_timeout(hkcp_node_t *node)
+{
+	node->timeout_tag = 0;
+
+	log_str("WARNING: Connection to node #%d='%s' timed out", node->id, node->name);
+	tcp_sock_shutdown(&node->tcp_sock);
+	hkcp_node_connect_failed(node);
+
+	return 0;
+}
+
+
+static void hkcp_node_connect_failed(hkcp_node_t *node)
+{
+	int delay;
+
+	if (node->timeout_tag) {
+		sys_remove(node->timeout_tag);
 		node->timeout_tag = 0;
+	}
+
+	node->connect_failures++;
+	node->hkcp->connect_failures++;
+	hkcp_node_set_state(node, HKCP_NODE_IDLE);
+
+	if (node->connect_attempts >= node->hkcp->retries) {
+		log_str("Too many connections attempted on node #%d='%s': giving up", node->id, node->name);
 		hkcp_node_remove(node);
-		return 0;
+		return;
 	}
 
-	if (node->timeout_tag == 0) {
-		node->timeout_tag = sys_timeout(5000, (sys_func_t) hkcp_node_connect, node);
+	delay = hkcp_node_retry_delay(node);
+	log_debug(2, "hkcp_node_connect_failed node=#%d='%s': retrying in %d ms", node->id, node->name, delay);
+	node->timeout_tag = sys_timeout(delay, (sys_func_t) hkcp_node_connect, node);
+}
+
+
+static void hkcp_node_connected(hkcp_node_t *node)
+{
+	hkcp_t *hkcp = node->hkcp;
+	unsigned long t = tstamp_ms() - node->connect_t0;
+
+	if (node->timeout_tag) {
+		sys_remove(node->timeout_tag);
+		node->timeout_tag = 0;
 	}
 
-	return 1;
+	/* Update connection metrics */
+	node->connect_time = t;
+	hkcp->connects++;
+	hkcp->connect_time += t;
+	if (t > hkcp->connect_time_max) {
+		hkcp->connect_time_max = t;
+	}
+
+	log_debug(2, "hkcp_node_connected node=#%d='%s': %lu ms", node->id, node->name, t);
+
+	tcp_sock_set_watermarks(&node->tcp_sock, hkcp->lowat, hkcp->hiwat);
+
+	/* Get list of sinks from this node, requesting binary framing */
+	hkcp_node_set_state(node, HKCP_NODE_SINKS);
+	node->binary = 0;
+	node->backlog.framed = 0;
+	node->sink_ids.nmemb = 0;
+	hkcp_bitmap_cleanup(&node->synced);
+	tcp_sock_write(&node->tcp_sock, "sinks binary\n", 13);
 }
 
 
-static int hkcp_node_connect_first(hkcp_node_t *node)
+static void hkcp_node_disconnect(hkcp_node_t *node)
 {
-	node->timeout_tag = 0;
-	node->connect_attempts = 0;
-	hkcp_node_connect(node);
-	return 0;
+	log_str("WARNING: Node #%d='%s' too slow: disconnecting", node->id, node->name);
+
+	node->disconnects++;
+	node->hkcp->disconnects++;
+
+	tcp_sock_shutdown(&node->tcp_sock);
+	hkcp_backlog_clear(&node->backlog);
+	hkcp_node_set_state(node, HKCP_NODE_IDLE);
+
+	/* Reconnect after a backoff delay: initial values will be sent again */
+	if (node->timeout_tag == 0) {
+		node->timeout_tag = sys_timeout(hkcp_node_retry_delay(node), (sys_func_t) hkcp_node_connect, node);
+	}
+}
+
+
+static void hkcp_node_write(hkcp_node_t *node, hk_source_t *source)
+{
+	if (hkcp_backlog_write(node->hkcp, &node->backlog, &node->tcp_sock, source, (hkcp_backlog_format_t) hkcp_format_set, node)) {
+		hkcp_node_disconnect(node);
+	}
 }
 
 
@@ -388,10 +955,10 @@ void hkcp_node_add(hkcp_t *hkcp, char *remote_ip)
 		node->name = strdup(remote_ip);
 	}
 
-	/* Try to connect */
-	if (!tcp_sock_is_connected(&node->tcp_sock)) {
+	/* Try to connect, unless a connection attempt or retry is already in progress */
+	if (node->state == HKCP_NODE_IDLE) {
 		if (node->timeout_tag == 0) {
-			node->timeout_tag = sys_timeout(10, (sys_func_t) hkcp_node_connect_first, node);
+			node->timeout_tag = sys_timeout(10, (sys_func_t) hkcp_node_connect, node);
 		}
 	}
 }
@@ -401,17 +968,28 @@ void hkcp_node_dump(hkcp_t *hkcp, hk_source_t *source, buf_t *out_buf)
 {
         int i;
 
-	/* Dump all nodes having this source */
-        for (i = 0; i < hkcp->nodes.nmemb; i++) {
-                hkcp_node_t *node = HK_TAB_VALUE(hkcp->nodes, hkcp_node_t *, i);
+	/* Dump all nodes */
+	if (source == NULL) {
+		for (i = 0; i < hkcp->nodes.nmemb; i++) {
+			hkcp_node_t *node = HK_TAB_VALUE(hkcp->nodes, hkcp_node_t *, i);
 
-		if (node != NULL) {
-			if ((source == NULL) || hkcp_node_source_attached(node, source)) {
+			if (node != NULL) {
 				buf_append_str(out_buf, " ");
 				buf_append_str(out_buf, node->name);
 			}
 		}
-        }
+	}
+
+	/* Dump all nodes having this source */
+	else {
+		hk_tab_t *subscribers = hkcp_subscribers(hkcp, source);
+
+		for (i = 0; (subscribers != NULL) && (i < subscribers->nmemb); i++) {
+			hkcp_node_t *node = HK_TAB_VALUE(*subscribers, hkcp_node_t *, i);
+			buf_append_str(out_buf, " ");
+			buf_append_str(out_buf, node->name);
+		}
+	}
 }
 
 
@@ -426,73 +1004,78 @@ static void hkcp_node_send_initial_value(hkcp_node_t *node, hk_source_t *source)
 
 	/* Send initial value if node is attached to source */
 	if (hkcp_node_source_attached(node, source)) {
-		int size = strlen(source->ep.obj->name) + source->ep.value.len + 10;
-		char str[size];
-		int len;
-
-		len = snprintf(str, size-1, "set %s=%s", source->ep.obj->name, source->ep.value.base);
-		log_debug(2, "hkcp_node_send_initial_value node=#%d='%s' cmd='%s'", node->id, node->name, str);
-		str[len++] = '\n';
-
-		tcp_sock_write(&node->tcp_sock, str, len);
+		hkcp_node_write(node, source);
 	}
 }
 
 
-static int hkcp_source_send_watch(tcp_sock_t *tcp_sock, char *str)
+static int hkcp_source_send_watch(tcp_sock_t *tcp_sock, hk_source_t *source)
 {
 	hkcp_command_ctx_t *ctx = tcp_sock_get_data(tcp_sock);
 
-	if (ctx->watch) {
-		tcp_sock_write(tcp_sock, str, strlen(str));
+	if ((ctx != NULL) && ctx->watch) {
+		hkcp_t *hkcp = ctx->hkcp;
+
+		if (hkcp_backlog_write(hkcp, &ctx->backlog, tcp_sock, source, hkcp_format_watch, NULL)) {
+			log_str("WARNING: Watch client [%d] too slow: disconnecting", tcp_sock->chan.fd);
+			hkcp->disconnects++;
+
+			/* Stop watching now, but close the connection from the event loop:
+			   this update may come from a command received on this very connection,
+			   whose context is still in use */
+			hkcp_command_ctx_watch(ctx, 0);
+			ctx->close_tag = sys_timeout(0, (sys_func_t) hkcp_command_ctx_close, ctx);
+		}
 	}
 
 	return 1;
 }
 
 
-static void hkcp_source_send_nodes(hkcp_t *hkcp, hk_source_t *source, char *str, int len)
+static void hkcp_source_send_nodes(hkcp_t *hkcp, hk_source_t *source)
 {
+	hk_tab_t *subscribers = hkcp_subscribers(hkcp, source);
 	int i;
 
-	for (i = 0; i < hkcp->nodes.nmemb; i++) {
-		hkcp_node_t *node = HK_TAB_VALUE(hkcp->nodes, hkcp_node_t *, i);
+	if (subscribers == NULL) {
+		return;
+	}
 
-		if (node != NULL) {
-                        if (hkcp_node_source_attached(node, source)) {
-                                log_debug(2, "    node=#%d='%s'", node->id, node->name);
-                                tcp_sock_write(&node->tcp_sock, str, len);
-                        }
-                }
+	for (i = 0; i < subscribers->nmemb; i++) {
+		hkcp_node_t *node = HK_TAB_VALUE(*subscribers, hkcp_node_t *, i);
+
+		if (node->state == HKCP_NODE_READY) {
+			log_debug(2, "    node=#%d='%s'", node->id, node->name);
+			hkcp_node_write(node, source);
+		}
 	}
 }
 
 
-void hkcp_source_update(hkcp_t *hkcp, hk_source_t *source)
+static void hkcp_source_send_watchers(hkcp_t *hkcp, hk_source_t *source)
 {
-        char *tile_name = hk_ep_get_tile_name(&source->ep);
-	char *name = hk_ep_get_name(&source->ep);
-        char *value = hk_ep_get_value(&source->ep);
-	log_debug(3, "hkcp_source_update name='%s.%s' value='%s'", tile_name, name, value);
+	int i;
 
-	int size = strlen(name) + strlen(value) + 20;
-	char str[size];
-	int len;
+	/* Walk backwards, as slow watchers may be removed while iterating */
+	for (i = hkcp->watchers.nmemb-1; i >= 0; i--) {
+		tcp_sock_t *tcp_sock = HK_TAB_VALUE(hkcp->watchers, tcp_sock_t *, i);
+
+		if (tcp_sock->chan.fd >= 0) {
+			hkcp_source_send_watch(tcp_sock, source);
+		}
+	}
+}
+
+
+void hkcp_source_update(hkcp_t *hkcp, hk_source_t *source)
+{
+	log_debug(3, "hkcp_source_update name='%s.%s' value='%s'", hk_ep_get_tile_name(&source->ep), hk_ep_get_name(&source->ep), hk_ep_get_value(&source->ep));
 
 	/* Send update command to all nodes that subscribed this source */
-	len = snprintf(str, size-1, "set %s=%s", name, value);
-	log_debug(2, "  cmd='%s'", str);
-	str[len++] = '\n';
-	hkcp_source_send_nodes(hkcp, source, str, len);
+	hkcp_source_send_nodes(hkcp, source);
 
 	/* Send event to watchers */
-        if (hk_tile_nmemb() > 1) {
-                snprintf(str, size, "!%s.%s=%s\n", tile_name, name, value);
-        }
-        else {
-                snprintf(str, size, "!%s=%s\n", name, value);
-        }
-	tcp_srv_foreach_client(&hkcp->tcp_srv, (tcp_foreach_func_t) hkcp_source_send_watch, str);
+	hkcp_source_send_watchers(hkcp, source);
 }
 
 
@@ -517,19 +1100,71 @@ static hkcp_command_ctx_t *hkcp_command_ctx_new(tcp_sock_t *tcp_sock)
 	ctx->tcp_sock = tcp_sock;
 	ctx->cmd = command_new((command_handler_t) hkcp_command_ctx_recv, ctx);
 	ctx->watch = 0;
+	ctx->close_tag = 0;
+	hkcp_backlog_init(&ctx->backlog);
+	ctx->binary = 0;
+	buf_init(&ctx->rbuf);
+	buf_init(&ctx->value);
+
+	tcp_sock_set_watermarks(tcp_sock, ctx->hkcp->lowat, ctx->hkcp->hiwat);
 
 	return ctx;
 }
 
 
+static void hkcp_command_ctx_watch(hkcp_command_ctx_t *ctx, int watch)
+{
+	hk_tab_t *watchers = &ctx->hkcp->watchers;
+	int i;
+
+	if (watch) {
+		if (!ctx->watch) {
+			HK_TAB_PUSH_VALUE(*watchers, ctx->tcp_sock);
+		}
+	}
+	else {
+		for (i = 0; i < watchers->nmemb; i++) {
+			if (HK_TAB_VALUE(*watchers, tcp_sock_t *, i) == ctx->tcp_sock) {
+				hk_tab_remove(watchers, i);
+				break;
+			}
+		}
+	}
+
+	ctx->watch = watch;
+}
+
+
 static void hkcp_command_ctx_destroy(hkcp_command_ctx_t *ctx)
 {
+	if (ctx->close_tag) {
+		sys_remove(ctx->close_tag);
+		ctx->close_tag = 0;
+	}
+
+	hkcp_command_ctx_watch(ctx, 0);
 	command_destroy(ctx->cmd);
+	hkcp_backlog_cleanup(&ctx->backlog);
+	buf_cleanup(&ctx->rbuf);
+	buf_cleanup(&ctx->value);
 	memset(ctx, 0, sizeof(hkcp_command_ctx_t));
 	free(ctx);
 }
 
 
+static int hkcp_command_ctx_close(hkcp_command_ctx_t *ctx)
+{
+	tcp_sock_t *tcp_sock = ctx->tcp_sock;
+
+	ctx->close_tag = 0;
+	hkcp_command_ctx_destroy(ctx);
+	tcp_sock_set_data(tcp_sock, NULL);
+	tcp_sock_shutdown(tcp_sock);
+
+	return 0;
+}
+
+
 /*
  * TCP/stdin/websocket commands
  */
@@ -550,7 +1185,15 @@ static int hkcp_command_tcp(hkcp_t *hkcp, int argc, char **argv, tcp_sock_t *tcp
 
 	if (strcmp(argv[0], "watch") == 0) {
 		hkcp_command_ctx_t *ctx = tcp_sock_get_data(tcp_sock);
-		hkcp_command_watch(argc, argv, &out_buf, &ctx->watch);
+		int watch = ctx->watch;
+		hkcp_command_watch(argc, argv, &out_buf, &watch);
+		hkcp_command_ctx_watch(ctx, watch);
+	}
+	else if ((strcmp(argv[0], "sinks") == 0) && (argc == 2) && (strcmp(argv[1], "binary") == 0)) {
+		/* Switch to binary framing once sinks list is sent */
+		hkcp_command_ctx_t *ctx = tcp_sock_get_data(tcp_sock);
+		hkcp_command_sinks_binary(&out_buf);
+		ctx->binary = 1;
 	}
 	else {
 		hkcp_command(hkcp, argc, argv, &out_buf);
@@ -564,6 +1207,109 @@ static int hkcp_command_tcp(hkcp_t *hkcp, int argc, char **argv, tcp_sock_t *tcp
 }
 
 
+/*
+ * Binary framing
+ */
+
+static void hkcp_frame_process(hkcp_command_ctx_t *ctx, unsigned char *frame, int size)
+{
+	unsigned long long id;
+	unsigned long long u;
+	hk_sink_t *sink;
+	int n;
+
+	if (size < 2) {
+		return;
+	}
+
+	n = buf_parse_varint(frame+1, size-1, &id);
+	if (n <= 0) {
+		log_str("WARNING: HKCP connection [%d]: malformed frame", ctx->tcp_sock->chan.fd);
+		return;
+	}
+
+	sink = hk_sink_retrieve_by_id(id);
+	if (sink == NULL) {
+		char str[64];
+		int len = snprintf(str, sizeof(str), ".ERROR: Unknown sink id: %llu\n", id);
+		tcp_sock_write(ctx->tcp_sock, str, len);
+		return;
+	}
+
+	n++;
+
+	switch (frame[0]) {
+	case HKCP_FRAME_SET_STR:
+		buf_set(&ctx->value, frame+n, size-n);
+		hk_sink_update(sink, (char *) ctx->value.base);
+		break;
+	case HKCP_FRAME_SET_INT:
+		if (buf_parse_varint(frame+n, size-n, &u) > 0) {
+			char value[24];
+			snprintf(value, sizeof(value), "%lld", BUF_UNZIGZAG(u));
+			hk_sink_update(sink, value);
+		}
+		break;
+	default:
+		log_str("WARNING: HKCP connection [%d]: unknown frame type %02X", ctx->tcp_sock->chan.fd, frame[0]);
+		break;
+	}
+}
+
+
+/* Process complete frames. Returns the number of bytes consumed, or -1 if stream is corrupted */
+static int hkcp_frame_parse(hkcp_command_ctx_t *ctx, unsigned char *buf, int len)
+{
+	int ofs = 0;
+
+	while (ofs < len) {
+		unsigned long long size;
+		int n = buf_parse_varint(buf+ofs, len-ofs, &size);
+
+		if ((n < 0) || (size > HKCP_FRAME_MAXSIZE)) {
+			return -1;
+		}
+
+		if ((n == 0) || ((ofs + n + size) > len)) {
+			break;
+		}
+
+		hkcp_frame_process(ctx, buf+ofs+n, size);
+		ofs += n + size;
+	}
+
+	return ofs;
+}
+
+
+static int hkcp_frame_recv(hkcp_command_ctx_t *ctx, char *rbuf, int rsize)
+{
+	int ret;
+
+	/* Parse received data in place if no incomplete frame is pending */
+	if (ctx->rbuf.len == 0) {
+		ret = hkcp_frame_parse(ctx, (unsigned char *) rbuf, rsize);
+		if ((ret >= 0) && (ret < rsize)) {
+			buf_append(&ctx->rbuf, (unsigned char *) rbuf + ret, rsize - ret);
+		}
+	}
+	else {
+		buf_append(&ctx->rbuf, (unsigned char *) rbuf, rsize);
+		ret = hkcp_frame_parse(ctx, ctx->rbuf.base, ctx->rbuf.len);
+		if (ret >= 0) {
+			buf_shift(&ctx->rbuf, ret);
+		}
+	}
+
+	if (ret < 0) {
+		log_str("ERROR: HKCP connection [%d]: corrupted frame stream", ctx->tcp_sock->chan.fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+
 static void hkcp_tcp_event(tcp_sock_t *tcp_sock, tcp_io_t io, char *rbuf, int rsize)
 {
 	hkcp_command_ctx_t *ctx;
@@ -580,12 +1326,34 @@ static void hkcp_tcp_event(tcp_sock_t *tcp_sock, tcp_io_t io, char *rbuf, int rs
 	case TCP_IO_DATA:
 		log_debug(2, "  DATA %d", rsize);
 		ctx = tcp_sock_get_data(tcp_sock);
-		command_recv(ctx->cmd, rbuf, rsize);
+		if ((ctx == NULL) || ctx->close_tag) {
+			/* Connection is being closed: ignore further commands */
+			break;
+		}
+		if (ctx->binary) {
+			if (hkcp_frame_recv(ctx, rbuf, rsize)) {
+				hkcp_command_ctx_destroy(ctx);
+				tcp_sock_set_data(tcp_sock, NULL);
+				tcp_sock_shutdown(tcp_sock);
+			}
+		}
+		else {
+			command_recv(ctx->cmd, rbuf, rsize);
+		}
 		break;
 	case TCP_IO_HUP:
 		log_debug(2, "  HUP");
 		ctx = tcp_sock_get_data(tcp_sock);
-		hkcp_command_ctx_destroy(ctx);
+		if (ctx != NULL) {
+			hkcp_command_ctx_destroy(ctx);
+		}
+		break;
+	case TCP_IO_DRAIN:
+		log_debug(2, "  DRAIN");
+		ctx = tcp_sock_get_data(tcp_sock);
+		if ((ctx != NULL) && (ctx->close_tag == 0)) {
+			hkcp_backlog_flush(&ctx->backlog, tcp_sock, hkcp_format_watch, NULL, NULL);
+		}
 		break;
 	default:
 		log_str("  PANIC: unknown event caught");
@@ -608,6 +1376,37 @@ int hkcp_init(hkcp_t *hkcp, int port, char *certs)
 
 	/* Init node management */
 	hk_tab_init(&hkcp->nodes, sizeof(hkcp_node_t *));
+	hk_tab_init(&hkcp->subscribers, sizeof(hk_tab_t));
+	hk_tab_init(&hkcp->watchers, sizeof(tcp_sock_t *));
+
+	/* Init slow peer management */
+	if (opt_hkcp_hiwat > 0) {
+		hkcp->hiwat = opt_hkcp_hiwat;
+	}
+	hkcp->lowat = (opt_hkcp_lowat >= 0) ? opt_hkcp_lowat : (hkcp->hiwat / 4);
+
+	if (opt_hkcp_policy != NULL) {
+		int i;
+
+		for (i = 0; i < HKCP_POLICY_N; i++) {
+			if (strcmp(opt_hkcp_policy, hkcp_policy_names[i]) == 0) {
+				break;
+			}
+		}
+
+		if (i < HKCP_POLICY_N) {
+			hkcp->policy = i;
+		}
+		else {
+			log_str("WARNING: Unknown HKCP slow peer policy '%s': using '%s'", opt_hkcp_policy, hkcp_policy_names[hkcp->policy]);
+		}
+	}
+
+	/* Init node connection retries */
+	hkcp->retries = (opt_hkcp_retries > 0) ? opt_hkcp_retries : HKCP_NODE_CONNECT_RETRIES;
+	hkcp->retry_min = (opt_hkcp_retry_min > 0) ? opt_hkcp_retry_min : HKCP_NODE_RETRY_MIN;
+	hkcp->retry_max = (opt_hkcp_retry_max > hkcp->retry_min) ? opt_hkcp_retry_max : hkcp->retry_min;
+	hkcp->seed = tstamp_t0() ^ getpid();
 
 	/* Init TCP server */
 	hkcp->port = port;
@@ -635,15 +1434,72 @@ DONE:
 
 void hkcp_shutdown(hkcp_t *hkcp)
 {
+	int i;
+
 	if (hkcp->tcp_srv.csock.chan.fd > 0) {
 		tcp_srv_shutdown(&hkcp->tcp_srv);
 	}
 
 	hk_tab_cleanup(&hkcp->nodes);
 
+	for (i = 0; i < hkcp->subscribers.nmemb; i++) {
+		hk_tab_cleanup(HK_TAB_PTR(hkcp->subscribers, hk_tab_t, i));
+	}
+	hk_tab_cleanup(&hkcp->subscribers);
+	hk_tab_cleanup(&hkcp->watchers);
+
         if (hkcp->certs != NULL) {
                 free(hkcp->certs);
         }
 
 	memset(hkcp, 0, sizeof(hkcp_t));
 }
+
+
+void hkcp_stats_reset(hkcp_t *hkcp)
+{
+	int i;
+
+	hkcp->dropped = 0;
+	hkcp->coalesced = 0;
+	hkcp->disconnects = 0;
+	hkcp->connects = 0;
+	hkcp->connect_failures = 0;
+	hkcp->connect_time = 0;
+	hkcp->connect_time_max = 0;
+
+	for (i = 0; i < hkcp->nodes.nmemb; i++) {
+		hkcp_node_t *node = HK_TAB_VALUE(hkcp->nodes, hkcp_node_t *, i);
+
+		if (node != NULL) {
+			node->backlog.dropped = 0;
+			node->backlog.coalesced = 0;
+			node->disconnects = 0;
+			node->connect_failures = 0;
+		}
+	}
+}
+
+
+void hkcp_stats_dump(hkcp_t *hkcp, buf_t *out_buf)
+{
+	int i;
+
+	buf_append_fmt(out_buf, "hkcp: policy=%s lowat=%d hiwat=%d dropped=%lu coalesced=%lu disconnects=%lu\n",
+		       hkcp_policy_names[hkcp->policy], hkcp->lowat, hkcp->hiwat,
+		       hkcp->dropped, hkcp->coalesced, hkcp->disconnects);
+	buf_append_fmt(out_buf, "hkcp: retries=%d retry=%d..%dms connects=%lu connect_failures=%lu connect_time_avg=%lums connect_time_max=%lums\n",
+		       hkcp->retries, hkcp->retry_min, hkcp->retry_max, hkcp->connects, hkcp->connect_failures,
+		       hkcp->connects ? (hkcp->connect_time / hkcp->connects) : 0, hkcp->connect_time_max);
+
+	for (i = 0; i < hkcp->nodes.nmemb; i++) {
+		hkcp_node_t *node = HK_TAB_VALUE(hkcp->nodes, hkcp_node_t *, i);
+
+		if (node != NULL) {
+			buf_append_fmt(out_buf, "node %s: wbuf=%d dropped=%lu coalesced=%lu disconnects=%lu connect_time=%lums connect_failures=%lu\n",
+				       node->name, node->tcp_sock.wbuf.len,
+				       node->backlog.dropped, node->backlog.coalesced, node->disconnects,
+				       node->connect_time, node->connect_failures);
+		}
+	}
+}
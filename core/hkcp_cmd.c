@@ -15,6 +15,7 @@
 #include "buf.h"
 #include "tab.h"
 #include "tstamp.h"
+#include "sys.h"
 #include "endpoint.h"
 #include "hakit_version.h"
 #include "hkcp.h"
@@ -173,6 +174,29 @@ static void hkcp_command_sinks(buf_t *out_buf)
 }
 
 
+static int hkcp_command_sinks_binary_dump(buf_t *out_buf, hk_sink_t *sink)
+{
+        if (hk_sink_is_public(sink)) {
+                hk_ep_append_name(HK_EP(sink), out_buf);
+                buf_append_fmt(out_buf, " @%d \"", sink->ep.id);
+                hk_ep_append_value(HK_EP(sink), out_buf);
+                buf_append_str(out_buf, "\"\n");
+        }
+
+        return 1;
+}
+
+
+/* Same as 'sinks', giving sink ids for binary framing,
+   with terminator '.binary <instance>' to confirm binary framing is enabled.
+   The instance id lets reconnecting peers know whether sink values were kept */
+void hkcp_command_sinks_binary(buf_t *out_buf)
+{
+        hk_sink_foreach((hk_ep_foreach_func_t) hkcp_command_sinks_binary_dump, out_buf);
+	buf_append_fmt(out_buf, ".binary %llu\n", (unsigned long long) tstamp_t0());
+}
+
+
 static int hkcp_command_watch_source(buf_t *out_buf, hk_source_t *source)
 {
         buf_append_str(out_buf, "!");
@@ -218,6 +242,30 @@ void hkcp_command_watch(int argc, char **argv, buf_t *out_buf, int *pwatch)
 }
 
 
+static void hkcp_command_stats(hkcp_t *hkcp, int argc, char **argv, buf_t *out_buf)
+{
+	/* Start collecting event loop statistics on first request */
+	sys_stats_enable();
+
+	if (argc > 1) {
+		if ((argc == 2) && (strcmp(argv[1], "reset") == 0)) {
+			sys_stats_reset();
+			hkcp_stats_reset(hkcp);
+		}
+		else {
+			buf_append_str(out_buf, ".ERROR: stats: Syntax error\n");
+			return;
+		}
+	}
+	else {
+		sys_stats_dump(out_buf);
+		hkcp_stats_dump(hkcp, out_buf);
+	}
+
+	buf_append_str(out_buf, ".\n");
+}
+
+
 void hkcp_command(hkcp_t *hkcp, int argc, char **argv, buf_t *out_buf)
 {
 	if (strcmp(argv[0], "set") == 0) {
@@ -242,6 +290,9 @@ void hkcp_command(hkcp_t *hkcp, int argc, char **argv, buf_t *out_buf)
 		buf_append_fmt(out_buf, "TRACE_DEPTH: %d\n", hk_endpoints_get_trace_depth());
 		buf_append_str(out_buf, ".\n");
 	}
+	else if (strcmp(argv[0], "stats") == 0) {
+		hkcp_command_stats(hkcp, argc, argv, out_buf);
+	}
 	else {
 		buf_append_str(out_buf, ".ERROR: Unknown command: ");
 		buf_append_str(out_buf, argv[0]);
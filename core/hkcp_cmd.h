@@ -16,5 +16,6 @@
 
 extern void hkcp_command(hkcp_t *hkcp, int argc, char **argv, buf_t *out_buf);
 extern void hkcp_command_watch(int argc, char **argv, buf_t *out_buf, int *pwatch);
+extern void hkcp_command_sinks_binary(buf_t *out_buf);
 
 #endif /* __HAKIT_HKCP_CMD_H__ */
@@ -37,4 +37,13 @@ extern int buf_set_int(buf_t *buf, int v);
 
 extern void buf_shift(buf_t *buf, int ofs);
 
+/* Variable length integers (LEB128) */
+#define BUF_ZIGZAG(v) ((((unsigned long long) (v)) << 1) ^ ((unsigned long long) (((long long) (v)) >> 63)))
+#define BUF_UNZIGZAG(u) ((long long) ((u) >> 1) ^ -((long long) ((u) & 1)))
+
+extern int buf_varint_size(unsigned long long v);
+extern int buf_put_varint(unsigned char *ptr, unsigned long long v);
+extern int buf_append_varint(buf_t *buf, unsigned long long v);
+extern int buf_parse_varint(unsigned char *ptr, int len, unsigned long long *pv);
+
 #endif /* __HAKIT_BUF_H__ */
@@ -92,6 +92,7 @@ typedef struct {
 
 extern hk_sink_t *hk_sink_register(hk_obj_t *obj, int local);
 extern hk_sink_t *hk_sink_retrieve_by_name(char *name);
+extern hk_sink_t *hk_sink_retrieve_by_id(int id);
 extern void hk_sink_update_by_name(char *name, char *value);
 extern void hk_sink_foreach(hk_ep_foreach_func_t func, void *user_data);
 extern void hk_sink_foreach_public(hk_ep_func_t func, void *user_data);
@@ -108,10 +109,12 @@ extern char *hk_sink_update(hk_sink_t *sink, char *value);
 typedef struct {
 	hk_ep_t ep;
 	hk_tab_t local_sinks;   // Table of (hk_sink_t *);
+	unsigned long version;  // Value version, incremented on each update
 } hk_source_t;
 
 extern hk_source_t *hk_source_register(hk_obj_t *obj, int local, int event);
 extern hk_source_t *hk_source_retrieve_by_name(char *name);
+extern hk_source_t *hk_source_retrieve_by_id(int id);
 extern int hk_source_to_advertise(void);
 extern void hk_source_foreach(hk_ep_foreach_func_t func, void *user_data);
 extern void hk_source_foreach_public(hk_ep_func_t func, void *user_data);
@@ -0,0 +1,41 @@
+/*
+ * HAKit - The Home Automation KIT - www.hakit.net
+ * Copyright (C) 2014 Sylvain Giroudon
+ *
+ * String-keyed hash tables
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+#ifndef __HAKIT_HASH_H__
+#define __HAKIT_HASH_H__
+
+typedef struct hk_hash_entry_s hk_hash_entry_t;
+
+struct hk_hash_entry_s {
+	hk_hash_entry_t *next;
+	unsigned int hval;
+	char *key;
+	void *value;
+};
+
+typedef struct {
+	hk_hash_entry_t **buckets;
+	int nbuckets;
+	int nmemb;
+} hk_hash_t;
+
+extern unsigned int hk_hash_str(char *str);
+
+extern void hk_hash_init(hk_hash_t *hash);
+extern void hk_hash_cleanup(hk_hash_t *hash);
+
+/* Several values may be inserted with the same key.
+   They are retrieved in order of insertion. */
+extern void hk_hash_insert(hk_hash_t *hash, char *key, void *value);
+extern hk_hash_entry_t *hk_hash_first(hk_hash_t *hash, char *key);
+extern hk_hash_entry_t *hk_hash_next(hk_hash_entry_t *entry);
+
+#endif /* __HAKIT_HASH_H__ */
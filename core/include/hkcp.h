@@ -21,11 +21,59 @@
 typedef struct hkcp_s hkcp_t;
 
 
+/*
+ * Bitmap of sources, indexed by endpoint id
+ */
+
+typedef struct {
+	unsigned char *bits;
+	int size;               // Bitmap size in bytes
+} hkcp_bitmap_t;
+
+
+/*
+ * Binary framing.
+ * Negotiated with command 'sinks binary': peer replies with sink ids
+ * and terminator '.binary' if it supports binary framing.
+ * Frame: varint(size) type varint(sink_id) payload
+ */
+
+#define HKCP_FRAME_SET_STR 0x01   // Payload is the value string
+#define HKCP_FRAME_SET_INT 0x02   // Payload is an integer value, as a zigzag varint
+#define HKCP_FRAME_MAXSIZE (1024*1024)
+
+
+/*
+ * Slow peer management
+ */
+
+#define HKCP_HIWAT_DEFAULT (256*1024)
+
+typedef enum {
+	HKCP_POLICY_COALESCE=0,  // Keep only the latest value of event sources
+	HKCP_POLICY_DROP,        // Keep event updates in order, drop oldest ones
+	HKCP_POLICY_DISCONNECT,  // Disconnect peer
+	HKCP_POLICY_N
+} hkcp_policy_t;
+
+typedef struct {
+	buf_t lines;            // Event updates held back while peer is congested (drop policy)
+	hk_tab_t sources;       // Dirty sources, latest value sent when socket is writable
+	hkcp_bitmap_t dirty;    // Dirty sources bitmap
+	int framed;             // Held back updates are binary frames
+	unsigned long dropped;
+	unsigned long coalesced;
+} hkcp_backlog_t;
+
+
 /*
  * Nodes
  */
 
 #define HKCP_NODE_CONNECT_RETRIES 4
+#define HKCP_NODE_CONNECT_TIMEOUT 5000
+#define HKCP_NODE_RETRY_MIN 2000     // Default delay before first connection retry (ms)
+#define HKCP_NODE_RETRY_MAX 60000    // Default maximum delay between connection retries (ms)
 
 typedef enum {
 	HKCP_NODE_IDLE=0,
@@ -41,10 +89,21 @@ typedef struct {
 	tcp_sock_t tcp_sock;
 	hkcp_node_state_t state;
 	int connect_attempts;
+	unsigned long long connect_t0;   // Connection attempt start time (ms)
+	unsigned long connect_time;      // Last connection latency (ms)
+	unsigned long connect_failures;
 	sys_tag_t timeout_tag;
-	hk_tab_t sources;       // Table of (hk_source_t *)
+	hkcp_bitmap_t sources;  // Subscribed sources
+	int nsources;           // Number of subscribed sources
 	hkcp_t *hkcp;
 	buf_t rbuf;
+	hkcp_backlog_t backlog;
+	unsigned long disconnects;
+	int binary;             // Binary framing enabled
+	hk_tab_t sink_ids;      // Table of (int) indexed by source id: remote sink id
+	unsigned long long peer; // Peer instance id, to resume after reconnect
+	hk_tab_t versions;      // Table of (unsigned long) indexed by source id: value version last sent
+	hkcp_bitmap_t synced;   // Sources whose value is already known by the peer
 } hkcp_node_t;
 
 
@@ -57,12 +116,30 @@ struct hkcp_s {
         char *certs;
 	tcp_srv_t tcp_srv;
 	hk_tab_t nodes;       // Table of (hkcp_node_t *)
+	hk_tab_t subscribers; // Table of (hk_tab_t) indexed by source id: nodes subscribed to each source
+	hk_tab_t watchers;    // Table of (tcp_sock_t *): client connections with watch enabled
+	hkcp_policy_t policy;
+	int lowat;
+	int hiwat;
+	unsigned long dropped;
+	unsigned long coalesced;
+	unsigned long disconnects;
+	int retries;                     // Connection attempts before giving up
+	int retry_min;                   // Delay before first connection retry (ms)
+	int retry_max;                   // Maximum delay between connection retries (ms)
+	unsigned int seed;               // Connection retry jitter random seed
+	unsigned long connects;
+	unsigned long connect_failures;
+	unsigned long connect_time;      // Cumulated connection latency (ms)
+	unsigned long connect_time_max;
 };
 
 extern int hkcp_init(hkcp_t *hkcp, int port, char *certs);
 extern void hkcp_shutdown(hkcp_t *hkcp);
 extern void hkcp_node_add(hkcp_t *hkcp, char *remote_ip);
 extern void hkcp_node_dump(hkcp_t *hkcp, hk_source_t *source, buf_t *out_buf);
+extern void hkcp_stats_reset(hkcp_t *hkcp);
+extern void hkcp_stats_dump(hkcp_t *hkcp, buf_t *out_buf);
 
 extern void hkcp_source_update(hkcp_t *hkcp, hk_source_t *source);
 
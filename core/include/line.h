@@ -0,0 +1,21 @@
+/*
+ * HAKit - The Home Automation KIT
+ * Copyright (C) 2014 Sylvain Giroudon
+ *
+ * Line framing of received data
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+#ifndef __HAKIT_LINE_H__
+#define __HAKIT_LINE_H__
+
+#include "buf.h"
+
+typedef void (*line_func_t)(void *user_data, char *str, int len);
+
+extern int line_split(buf_t *pending, char *rbuf, int rsize, line_func_t func, void *user_data);
+
+#endif /* __HAKIT_LINE_H__ */
@@ -0,0 +1,34 @@
+/*
+ * HAKit - The Home Automation KIT - www.hakit.net
+ * Copyright (C) 2014 Sylvain Giroudon
+ *
+ * Ring buffers
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+#ifndef __HAKIT_RING_H__
+#define __HAKIT_RING_H__
+
+#include <sys/uio.h>
+
+typedef struct {
+	unsigned char *base;
+	int size;    // Allocated size (power of 2)
+	int head;    // Offset of first byte
+	int len;     // Number of bytes stored
+} ring_t;
+
+extern void ring_init(ring_t *ring);
+extern void ring_cleanup(ring_t *ring);
+
+extern int ring_append(ring_t *ring, unsigned char *ptr, int len);
+extern void ring_consume(ring_t *ring, int len);
+
+/* Get stored data as (at most 2) contiguous segments, in order.
+   Returns the number of segments. */
+extern int ring_iov(ring_t *ring, struct iovec iov[2]);
+
+#endif /* __HAKIT_RING_H__ */
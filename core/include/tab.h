@@ -10,7 +10,7 @@
 #ifndef __HAKIT_TAB_H__
 #define __HAKIT_TAB_H__
 
-#define HK_TAB_DECLARE(_var_, _type_) hk_tab_t _var_ = { .msize = sizeof(_type_), .buf = NULL, .nmemb = 0 }
+#define HK_TAB_DECLARE(_var_, _type_) hk_tab_t _var_ = { .msize = sizeof(_type_), .buf = NULL, .nmemb = 0, .size = 0, .free_tab = NULL, .free_n = 0, .free_size = 0 }
 #define HK_TAB_PUSH_VALUE(_var_, _value_) *((typeof(_value_) *) hk_tab_push(&(_var_))) = (_value_)
 
 #define HK_TAB_PTR(_var_, _type_, _index_) (((_type_ *) (_var_).buf)+(_index_))
@@ -22,11 +22,24 @@ typedef struct {
 	int msize;
 	void *buf;
 	int nmemb;
+	int size;        // Number of allocated elements
+	int *free_tab;   // Stack of released element indexes
+	int free_n;
+	int free_size;
 } hk_tab_t;
 
 extern void hk_tab_init(hk_tab_t *tab, int msize);
 extern void hk_tab_cleanup(hk_tab_t *tab);
+extern void hk_tab_reserve(hk_tab_t *tab, int nmemb);
 extern void *hk_tab_push(hk_tab_t *tab);
+extern void hk_tab_remove(hk_tab_t *tab, int index);
+extern void hk_tab_compact(hk_tab_t *tab);
 extern void hk_tab_foreach(hk_tab_t *tab, hk_tab_foreach_func func, void *user_data);
 
+/* Free element management: released elements are kept as they are
+   (it is up to the caller to mark them as unused), and are handed
+   back by hk_tab_alloc() before growing the table */
+extern int hk_tab_alloc(hk_tab_t *tab);
+extern void hk_tab_release(hk_tab_t *tab, int index);
+
 #endif /* __HAKIT_TAB_H__ */
@@ -15,23 +15,78 @@
 #include <stdint.h>
 
 #define HK_TRACE_DEFAULT_DEPTH 500
-#define HK_TRACE_MAX_DEPTH 10000
+#define HK_TRACE_MAX_DEPTH 100000
 
+#define HK_TRACE_VALUE_MAX 255     // Longer values are truncated
+#define HK_TRACE_BLOCK_SIZE 640    // Encoded points storage per block
+#define HK_TRACE_BLOCK_POINTS 128  // Maximum number of points per block
+#define HK_TRACE_POINT_SIZE 5      // Initial storage per point (bytes), enough for periodic numeric values
+#define HK_TRACE_POINT_SIZE_MAX 32 // Storage per point (bytes) the ring may grow to, to keep depth points
+
+/* Encoder/decoder state: last decoded point */
 typedef struct {
-        uint64_t t;
-        char *value;
-} hk_trace_entry_t;
+        uint64_t t;       // Time stamp (ms)
+        int64_t dt;       // Time stamp delta from previous point
+        unsigned long long seq;  // Sequence number
+        long long m;      // Last numeric value mantissa
+        int d;            // Last numeric value decimals
+} hk_trace_state_t;
 
+/* Points are stored as delta-of-delta time stamps, sequence number gaps,
+   followed by either a numeric value delta or a plain text value */
+typedef struct {
+        uint64_t t0;      // First point time stamp (ms)
+        unsigned long long seq0;  // First point sequence number
+        hk_trace_state_t st;
+        int npoints;
+        int len;
+        unsigned char data[HK_TRACE_BLOCK_SIZE];
+} hk_trace_block_t;
 
 typedef struct {
         char *name;
         int depth;
-        int iput, iget;
-        hk_trace_entry_t *tab;
+        int count;        // Number of points stored
+        unsigned long long seq;      // Last point sequence number
+        unsigned long long dropped;  // Last dropped point sequence number
+        int nblocks;      // Number of allocated blocks, grown on demand
+        int bfirst;       // Oldest block
+        int bcount;       // Number of blocks in use
+        hk_trace_block_t *blocks;
 } hk_trace_t;
 
+typedef struct {
+        uint64_t t;       // Time stamp (ms)
+        unsigned long long seq;  // Sequence number, shared by all traces
+        int numeric;
+        long long m;      // Numeric value = m / 10^d
+        int d;
+        char *text;       // Text value (not NUL-terminated)
+        int len;
+} hk_trace_point_t;
+
+typedef struct {
+        hk_trace_t *tr;
+        hk_trace_block_t *block;
+        int iblock;
+        int ipoint;
+        int ofs;
+        hk_trace_state_t st;
+        hk_trace_point_t pt;  // Current point
+} hk_trace_iter_t;
+
 extern void hk_trace_init(hk_trace_t *tr, char *name, int depth);
 extern void hk_trace_push(hk_trace_t *tr, char *value);
-extern void hk_trace_dump(hk_trace_t *tr, uint64_t t1, uint64_t t2, buf_t *out_buf);
+extern void hk_trace_dump(hk_trace_t *tr, uint64_t t1, uint64_t t2, int max, buf_t *out_buf);
+extern void hk_trace_dump_sampled(hk_trace_t *tr, uint64_t t1, uint64_t t2, int points, buf_t *out_buf);
+extern int hk_trace_dump_since(hk_trace_t *tr, unsigned long long seq, buf_t *out_buf);
+
+extern unsigned long long hk_trace_seq(void);
+
+extern void hk_trace_iter_init(hk_trace_iter_t *it, hk_trace_t *tr);
+extern void hk_trace_iter_seek(hk_trace_iter_t *it, uint64_t t);
+extern void hk_trace_iter_seek_seq(hk_trace_iter_t *it, unsigned long long seq);
+extern int hk_trace_iter_next(hk_trace_iter_t *it);
+extern void hk_trace_point_append(hk_trace_point_t *pt, buf_t *out_buf);
 
 #endif /* __HAKIT_TRACE_H__ */
@@ -14,8 +14,13 @@
 
 #include <stdint.h>
 
+/* Wall clock time (ms since Epoch) of the time stamp origin */
 extern uint64_t tstamp_t0(void);
+
+/* Monotonic time elapsed since the time stamp origin */
+extern uint64_t tstamp_us(void);
 extern uint64_t tstamp_ms(void);
+
 extern int tstamp_str(char *buf, int size);
 
 #endif /* __HAKIT_TSTAMP_H__ */
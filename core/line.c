@@ -0,0 +1,62 @@
+/*
+ * HAKit - The Home Automation KIT
+ * Copyright (C) 2014 Sylvain Giroudon
+ *
+ * Line framing of received data
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "line.h"
+
+
+/*
+ * Split received data into newline-terminated lines.
+ * Complete lines are NUL-terminated in place and handed to func without
+ * being copied. Only a line split across several reads is gathered in
+ * the pending buffer. Empty lines are skipped.
+ * Returns the number of lines processed.
+ */
+
+int line_split(buf_t *pending, char *rbuf, int rsize, line_func_t func, void *user_data)
+{
+	char *ptr = rbuf;
+	char *end = rbuf + rsize;
+	int count = 0;
+
+	while (ptr < end) {
+		char *eol = memchr(ptr, '\n', end - ptr);
+		char *str = ptr;
+		int len;
+
+		/* No end-of-line: keep partial line until next read */
+		if (eol == NULL) {
+			buf_append(pending, (unsigned char *) ptr, end - ptr);
+			break;
+		}
+
+		*eol = '\0';
+		len = eol - ptr;
+		ptr = eol + 1;
+
+		/* Complete the line started in a previous read */
+		if (pending->len > 0) {
+			buf_append(pending, (unsigned char *) str, len);
+			str = (char *) pending->base;
+			len = pending->len;
+			pending->len = 0;
+		}
+
+		if (len > 0) {
+			func(user_data, str, len);
+			count++;
+		}
+	}
+
+	return count;
+}
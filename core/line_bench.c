@@ -0,0 +1,183 @@
+/*
+ * HAKit - The Home Automation KIT
+ * Copyright (C) 2014 Sylvain Giroudon
+ *
+ * Line framer fuzz test and benchmark.
+ * Random input is fed to line_split() at random chunk boundaries,
+ * and the resulting lines are compared with a reference splitter
+ * working on the whole input at once.
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "line.h"
+
+#define FUZZ_ITERATIONS 200000
+#define FUZZ_INPUT_MAX 200
+
+#define BENCH_SIZE (1024*1024)
+#define BENCH_CHUNK 4000
+#define BENCH_LINE 64
+#define BENCH_ITERATIONS 200
+
+
+/* Collected lines, separated by '|' */
+typedef struct {
+	char buf[FUZZ_INPUT_MAX * 2];
+	int len;
+	int error;
+} lines_t;
+
+
+static void lines_collect(lines_t *lines, char *str, int len)
+{
+	/* Lines must be NUL-terminated and non-empty */
+	if ((len <= 0) || (strlen(str) != len)) {
+		lines->error = 1;
+		return;
+	}
+
+	memcpy(lines->buf + lines->len, str, len);
+	lines->len += len;
+	lines->buf[lines->len++] = '|';
+}
+
+
+/* Reference splitter: empty lines are skipped,
+   and a trailing incomplete line is not reported */
+static void lines_reference(lines_t *lines, char *input, int size)
+{
+	int start = 0;
+	int i;
+
+	lines->len = 0;
+	lines->error = 0;
+
+	for (i = 0; i < size; i++) {
+		if (input[i] == '\n') {
+			int len = i - start;
+			if (len > 0) {
+				memcpy(lines->buf + lines->len, input + start, len);
+				lines->len += len;
+				lines->buf[lines->len++] = '|';
+			}
+			start = i + 1;
+		}
+	}
+}
+
+
+static int fuzz(void)
+{
+	char input[FUZZ_INPUT_MAX];
+	char chunk[FUZZ_INPUT_MAX];
+	lines_t ref;
+	lines_t out;
+	buf_t pending;
+	int it;
+
+	buf_init(&pending);
+	srand(1);
+
+	for (it = 0; it < FUZZ_ITERATIONS; it++) {
+		int size = rand() % FUZZ_INPUT_MAX;
+		int pos = 0;
+		int i;
+
+		/* Short lines with frequent empty ones */
+		for (i = 0; i < size; i++) {
+			int r = rand() % 8;
+			input[i] = (r == 0) ? '\n' : ('a' + r);
+		}
+
+		lines_reference(&ref, input, size);
+
+		/* Feed input at random chunk boundaries.
+		   Chunks are copied, as line_split() modifies its input */
+		out.len = 0;
+		out.error = 0;
+		pending.len = 0;
+
+		while (pos < size) {
+			int len = 1 + (rand() % (size - pos));
+			memcpy(chunk, input + pos, len);
+			line_split(&pending, chunk, len, (line_func_t) lines_collect, &out);
+			pos += len;
+		}
+
+		if (out.error || (out.len != ref.len) || memcmp(out.buf, ref.buf, ref.len)) {
+			fprintf(stderr, "FAILED: iteration %d: got '%.*s', expected '%.*s'\n",
+				it, out.len, out.buf, ref.len, ref.buf);
+			buf_cleanup(&pending);
+			return -1;
+		}
+	}
+
+	buf_cleanup(&pending);
+	printf("fuzz: %d iterations OK\n", FUZZ_ITERATIONS);
+
+	return 0;
+}
+
+
+static void bench_count(int *count, char *str, int len)
+{
+	(*count)++;
+}
+
+
+static void bench(void)
+{
+	static char input[BENCH_SIZE];
+	static char work[BENCH_SIZE];
+	struct timespec t1, t2;
+	buf_t pending;
+	double dt;
+	int count = 0;
+	int it;
+	int i;
+
+	for (i = 0; i < BENCH_SIZE; i++) {
+		input[i] = ((i % BENCH_LINE) == (BENCH_LINE - 1)) ? '\n' : 'x';
+	}
+
+	buf_init(&pending);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	for (it = 0; it < BENCH_ITERATIONS; it++) {
+		memcpy(work, input, BENCH_SIZE);
+		for (i = 0; i < BENCH_SIZE; i += BENCH_CHUNK) {
+			int len = BENCH_SIZE - i;
+			if (len > BENCH_CHUNK) {
+				len = BENCH_CHUNK;
+			}
+			line_split(&pending, work + i, len, (line_func_t) bench_count, &count);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	buf_cleanup(&pending);
+
+	dt = (t2.tv_sec - t1.tv_sec) + ((t2.tv_nsec - t1.tv_nsec) / 1e9);
+	printf("bench: %d lines of %d bytes in %d-byte chunks: %.0f MB/s\n",
+	       count, BENCH_LINE, BENCH_CHUNK, ((double) BENCH_SIZE * BENCH_ITERATIONS) / dt / 1e6);
+}
+
+
+int main(int argc, char *argv[])
+{
+	if (fuzz()) {
+		return 1;
+	}
+
+	bench();
+
+	return 0;
+}
@@ -14,9 +14,7 @@
 #include <string.h>
 #include <errno.h>
 #include <malloc.h>
-#include <fcntl.h>
 #include <unistd.h>
-#include <mqueue.h>
 
 #include "sys.h"
 #include "mosquitto.h"
@@ -32,9 +30,6 @@
 #define MQTT_DEFAULT_SSL_PORT 8883
 #define MQTT_DEFAULT_KEEPALIVE 60
 
-/* Message queue */
-#define MSG_MAXSIZE 1024
-
 /* Reconnect delay */
 #define MQTT_RECONNECT_DELAY 60
 
@@ -52,14 +47,20 @@ struct __mqtt_s {
 	void *user_data;
 	mqtt_state_t state;
 	sys_tag_t timeout_tag;
-	mqd_t mq;
-	sys_tag_t mq_tag;
 	int port;
 	int qos;
 };
 
 
+typedef struct {
+	mqtt_t *mqtt;
+	char *topic;
+	char *value;
+} mqtt_msg_t;
+
+
 static int mqtt_connect_now(mqtt_t *mqtt);
+static int mqtt_msg_recv(mqtt_msg_t *m);
 
 
 static void mqtt_timeout_stop(mqtt_t *mqtt)
@@ -114,21 +115,30 @@ static void mqtt_on_message(struct mosquitto *mosq, void *obj, const struct mosq
 	mqtt_t *mqtt = obj;
 	int topiclen = strlen(msg->topic);
 	int msize = topiclen + 1 + msg->payloadlen + 1;
-	char mbuf[msize];
-	char *topic;
-	char *value;
+	mqtt_msg_t *m;
 
-	topic = &mbuf[0];
-	memcpy(topic, msg->topic, topiclen+1);
+	/* Message and its strings are allocated in one block */
+	m = malloc(sizeof(mqtt_msg_t) + msize);
+	if (m == NULL) {
+		log_str("PANIC: Cannot allocate MQTT message: %s", strerror(errno));
+		return;
+	}
+
+	m->mqtt = mqtt;
+
+	m->topic = (char *) &m[1];
+	memcpy(m->topic, msg->topic, topiclen+1);
 
-	value = &topic[topiclen+1];
-	memcpy(value, msg->payload, msg->payloadlen);
-	value[msg->payloadlen] = '\0';
+	m->value = &m->topic[topiclen+1];
+	memcpy(m->value, msg->payload, msg->payloadlen);
+	m->value[msg->payloadlen] = '\0';
 
-	log_debug(3, "MQTT message throw [%d]: %s='%s'", msize, topic, value);
+	log_debug(3, "MQTT message throw [%d]: %s='%s'", msize, m->topic, m->value);
 
-	if (mq_send(mqtt->mq, mbuf, msize, 0) < 0) {
-		log_str("PANIC: Cannot send MQTT message: %s", strerror(errno));
+	/* Forward message to the main loop thread */
+	if (sys_post((sys_func_t) mqtt_msg_recv, m) < 0) {
+		log_str("PANIC: Cannot send MQTT message");
+		free(m);
 	}
 }
 
@@ -158,34 +168,20 @@ static void mqtt_on_log(struct mosquitto *mosq, void *obj, int level, const char
 }
 
 
-static int mqtt_msg_recv(mqtt_t *mqtt, int fd)
+static int mqtt_msg_recv(mqtt_msg_t *m)
 {
-	char mbuf[MSG_MAXSIZE];
-	ssize_t msize;
+	mqtt_t *mqtt = m->mqtt;
 
-	msize = mq_receive(mqtt->mq, mbuf, sizeof(mbuf), NULL);
-	if (msize < 0) {
-		if ((errno != EAGAIN) && (errno != EINTR)) {
-			log_str("PANIC: Cannot handle MQTT message: %s", strerror(errno));
-		}
-		return 0;
-	}
+	log_debug(3, "MQTT message catch: %s='%s'", m->topic, m->value);
 
-	if (msize < 2) {
-		log_str("PANIC: Received MQTT message with illegal size (%d)", msize);
-		return 0;
+	/* Drop messages received while shutting down */
+	if ((mqtt->mosq != NULL) && (mqtt->update_func != NULL)) {
+		mqtt->update_func(mqtt->user_data, m->topic, m->value);
 	}
 
-	char *topic = &mbuf[0];
-	int topiclen = strlen(topic);
-	char *value = &mbuf[topiclen+1];
-	log_debug(3, "MQTT message catch [%d]: %s='%s'", msize, topic, value);
+	free(m);
 
-	if (mqtt->update_func != NULL) {
-		mqtt->update_func(mqtt->user_data, topic, value);
-	}
-
-	return 1;
+	return 0;
 }
 
 
@@ -292,7 +288,6 @@ int mqtt_init(mqtt_t *mqtt, char *certs,
 	int ret;
 
 	memset(mqtt, 0, sizeof(mqtt_t));
-	mqtt->mq = -1;
 
 	mosquitto_lib_version(&major, &minor, &revision);
 	log_str("Initialising MQTT: Mosquitto %d.%d.%d", major, minor, revision);
@@ -341,27 +336,7 @@ int mqtt_init(mqtt_t *mqtt, char *certs,
 		mqtt->port = MQTT_DEFAULT_PORT;
 	}
 
-	/* Create private messaging queue */
-	snprintf(id, sizeof(id), "/hakit-%d", getpid());
-	int flags = O_RDWR | O_CREAT | O_EXCL | O_NONBLOCK;
-	struct mq_attr attr = {
-		.mq_flags   = O_NONBLOCK,
-		.mq_maxmsg  = 8,
-		.mq_msgsize = MSG_MAXSIZE,
-	};
-
-	mqtt->mq = mq_open(id, flags, 0600, &attr);
-	if (mqtt->mq == -1) {
-		log_str("ERROR: Cannot create MQTT pipe: %s", strerror(errno));
-		goto failed;
-	}
-
-	mq_unlink(id);  // Hide message queue from other processes
-
-	/* Message queue receive callback */
-	mqtt->mq_tag = sys_io_watch(mqtt->mq, (sys_io_func_t) mqtt_msg_recv, mqtt);
-
-	/* Start MQTT thread */
+	/* Start MQTT thread (messages are forwarded using sys_post()) */
 	ret = mosquitto_loop_start(mqtt->mosq);
 	if (ret != MOSQ_ERR_SUCCESS) {
 		log_str("ERROR: Failed to start MQTT: %s", mosquitto_strerror(ret));
@@ -381,17 +356,6 @@ void mqtt_shutdown(mqtt_t *mqtt)
 	/* Cancel running timer */
 	mqtt_timeout_stop(mqtt);
 
-	/* Close messaging pipe endpoints */
-	if (mqtt->mq_tag != 0) {
-		sys_remove(mqtt->mq_tag);
-		mqtt->mq_tag = 0;
-	}
-
-	if (mqtt->mq != -1) {
-		mq_close(mqtt->mq);
-		mqtt->mq = -1;
-	}
-
 	/* Kill Mosquitto instance */
 	if (mqtt->mosq != NULL) {
 		mosquitto_destroy(mqtt->mosq);
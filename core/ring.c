@@ -0,0 +1,147 @@
+/*
+ * HAKit - The Home Automation KIT - www.hakit.net
+ * Copyright (C) 2014 Sylvain Giroudon
+ *
+ * Ring buffers
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+
+#include "ring.h"
+
+#define RING_MIN_SIZE 1024
+
+
+void ring_init(ring_t *ring)
+{
+	ring->base = NULL;
+	ring->size = 0;
+	ring->head = 0;
+	ring->len = 0;
+}
+
+
+void ring_cleanup(ring_t *ring)
+{
+	if (ring->base != NULL) {
+		free(ring->base);
+	}
+
+	ring_init(ring);
+}
+
+
+static int ring_grow(ring_t *ring, int needed_size)
+{
+	unsigned char *base;
+	int size = ring->size ? ring->size : RING_MIN_SIZE;
+	struct iovec iov[2];
+	int n, i;
+	int ofs = 0;
+
+	while (size < needed_size) {
+		size *= 2;
+	}
+
+	base = malloc(size);
+	if (base == NULL) {
+		return -1;
+	}
+
+	/* Move stored data to the beginning of the new buffer */
+	n = ring_iov(ring, iov);
+	for (i = 0; i < n; i++) {
+		memcpy(base + ofs, iov[i].iov_base, iov[i].iov_len);
+		ofs += iov[i].iov_len;
+	}
+
+	if (ring->base != NULL) {
+		free(ring->base);
+	}
+
+	ring->base = base;
+	ring->size = size;
+	ring->head = 0;
+
+	return 0;
+}
+
+
+int ring_append(ring_t *ring, unsigned char *ptr, int len)
+{
+	int tail, n;
+
+	if (len <= 0) {
+		return 0;
+	}
+
+	if ((ring->len + len) > ring->size) {
+		if (ring_grow(ring, ring->len + len)) {
+			return -1;
+		}
+	}
+
+	tail = (ring->head + ring->len) & (ring->size - 1);
+
+	/* Copy up to the end of buffer, then wrap around */
+	n = ring->size - tail;
+	if (n > len) {
+		n = len;
+	}
+	memcpy(ring->base + tail, ptr, n);
+	if (n < len) {
+		memcpy(ring->base, ptr + n, len - n);
+	}
+
+	ring->len += len;
+
+	return len;
+}
+
+
+void ring_consume(ring_t *ring, int len)
+{
+	if (len <= 0) {
+		return;
+	}
+
+	if (len < ring->len) {
+		ring->head = (ring->head + len) & (ring->size - 1);
+		ring->len -= len;
+	}
+	else {
+		/* Restart from beginning, so that next data are contiguous */
+		ring->head = 0;
+		ring->len = 0;
+	}
+}
+
+
+int ring_iov(ring_t *ring, struct iovec iov[2])
+{
+	int n;
+
+	if (ring->len <= 0) {
+		return 0;
+	}
+
+	n = ring->size - ring->head;
+	if (n >= ring->len) {
+		iov[0].iov_base = ring->base + ring->head;
+		iov[0].iov_len = ring->len;
+		return 1;
+	}
+
+	iov[0].iov_base = ring->base + ring->head;
+	iov[0].iov_len = n;
+	iov[1].iov_base = ring->base;
+	iov[1].iov_len = ring->len - n;
+
+	return 2;
+}
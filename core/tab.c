@@ -10,17 +10,24 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <malloc.h>
 
 #include "tab.h"
 
+#define HK_TAB_MIN_SIZE 8
+
 
 void hk_tab_init(hk_tab_t *tab, int msize)
 {
 	tab->buf = NULL;
 	tab->nmemb = 0;
+	tab->size = 0;
 	tab->msize = msize;
+	tab->free_tab = NULL;
+	tab->free_n = 0;
+	tab->free_size = 0;
 }
 
 
@@ -30,6 +37,23 @@ void hk_tab_cleanup(hk_tab_t *tab)
 	free(tab->buf);
 	tab->buf = NULL;
 	tab->nmemb = 0;
+	tab->size = 0;
+
+	if (tab->free_tab != NULL) {
+		free(tab->free_tab);
+		tab->free_tab = NULL;
+	}
+	tab->free_n = 0;
+	tab->free_size = 0;
+}
+
+
+void hk_tab_reserve(hk_tab_t *tab, int nmemb)
+{
+	if (nmemb > tab->size) {
+		tab->size = nmemb;
+		tab->buf = realloc(tab->buf, tab->msize * tab->size);
+	}
 }
 
 
@@ -37,8 +61,13 @@ void *hk_tab_push(hk_tab_t *tab)
 {
 	void *p;
 	int i = tab->nmemb;
+
+	/* Grow geometrically, to keep push amortized O(1) */
+	if (tab->nmemb >= tab->size) {
+		hk_tab_reserve(tab, tab->size ? (tab->size * 2) : HK_TAB_MIN_SIZE);
+	}
+
 	tab->nmemb++;
-	tab->buf = realloc(tab->buf, tab->msize * tab->nmemb);
 
 	p = tab->buf + (tab->msize * i);
 	memset(p, 0, tab->msize);
@@ -47,6 +76,102 @@ void *hk_tab_push(hk_tab_t *tab)
 }
 
 
+void hk_tab_remove(hk_tab_t *tab, int index)
+{
+	int i;
+
+	if ((index < 0) || (index >= tab->nmemb)) {
+		return;
+	}
+
+	/* Shift following elements */
+	tab->nmemb--;
+	if (index < tab->nmemb) {
+		memmove(tab->buf + (tab->msize * index),
+			tab->buf + (tab->msize * (index + 1)),
+			tab->msize * (tab->nmemb - index));
+	}
+
+	/* Update free element indexes accordingly */
+	i = 0;
+	while (i < tab->free_n) {
+		if (tab->free_tab[i] == index) {
+			tab->free_tab[i] = tab->free_tab[--tab->free_n];
+		}
+		else {
+			if (tab->free_tab[i] > index) {
+				tab->free_tab[i]--;
+			}
+			i++;
+		}
+	}
+}
+
+
+static int hk_tab_free_cmp(const void *p1, const void *p2)
+{
+	int i1 = *((const int *) p1);
+	int i2 = *((const int *) p2);
+
+	return (i1 > i2) - (i1 < i2);
+}
+
+
+void hk_tab_compact(hk_tab_t *tab)
+{
+	/* Drop released elements at end of table.
+	   Sort the free stack once, so that trailing elements are trimmed
+	   in a single pass from its top */
+	if (tab->free_n > 1) {
+		qsort(tab->free_tab, tab->free_n, sizeof(int), hk_tab_free_cmp);
+	}
+
+	while ((tab->free_n > 0) && (tab->free_tab[tab->free_n - 1] == (tab->nmemb - 1))) {
+		tab->free_n--;
+		tab->nmemb--;
+	}
+
+	/* Release unused memory */
+	if (tab->nmemb < tab->size) {
+		tab->size = tab->nmemb;
+		if (tab->size > 0) {
+			tab->buf = realloc(tab->buf, tab->msize * tab->size);
+		}
+		else {
+			free(tab->buf);
+			tab->buf = NULL;
+		}
+	}
+}
+
+
+int hk_tab_alloc(hk_tab_t *tab)
+{
+	/* Reuse the most recently released element, if any */
+	if (tab->free_n > 0) {
+		return tab->free_tab[--tab->free_n];
+	}
+
+	hk_tab_push(tab);
+	return tab->nmemb - 1;
+}
+
+
+void hk_tab_release(hk_tab_t *tab, int index)
+{
+	if ((index < 0) || (index >= tab->nmemb)) {
+		return;
+	}
+
+	if (tab->free_n >= tab->free_size) {
+		tab->free_size = tab->free_size ? (tab->free_size * 2) : HK_TAB_MIN_SIZE;
+		tab->free_tab = realloc(tab->free_tab, tab->free_size * sizeof(int));
+	}
+
+	tab->free_tab[tab->free_n++] = index;
+}
+
+
 void hk_tab_foreach(hk_tab_t *tab, hk_tab_foreach_func func, void *user_data)
 {
 	int i;
@@ -18,6 +18,19 @@
 #include "buf.h"
 #include "trace.h"
 
+/* Sequence number of last recorded point, shared by all traces */
+static unsigned long long hk_trace_seq_last = 0;
+
+
+/* Number of blocks needed to store depth points of given size, plus the one being filled */
+static int hk_trace_nblocks(int depth, int point_size)
+{
+        int n1 = ((depth * point_size) + HK_TRACE_BLOCK_SIZE - 1) / HK_TRACE_BLOCK_SIZE;
+        int n2 = (depth + HK_TRACE_BLOCK_POINTS - 1) / HK_TRACE_BLOCK_POINTS;
+
+        return ((n1 > n2) ? n1 : n2) + 1;
+}
+
 
 void hk_trace_init(hk_trace_t *tr, char *name, int depth)
 {
@@ -36,105 +49,725 @@ void hk_trace_init(hk_trace_t *tr, char *name, int depth)
                 tr->depth = depth;
         }
 
-        tr->tab = calloc(tr->depth, sizeof(hk_trace_entry_t));
+        /* Allocate enough blocks to hold depth typical points, plus the one being filled.
+           The ring grows if actual points are larger */
+        tr->nblocks = hk_trace_nblocks(tr->depth, HK_TRACE_POINT_SIZE);
+        tr->blocks = malloc(tr->nblocks * sizeof(hk_trace_block_t));
+}
+
+
+unsigned long long hk_trace_seq(void)
+{
+        return hk_trace_seq_last;
+}
+
+
+void hk_trace_clear(hk_trace_t *tr)
+{
+        tr->dropped = tr->seq;
+        tr->count = 0;
+        tr->bfirst = 0;
+        tr->bcount = 0;
 }
 
 
-static int hk_trace_clear_entry(hk_trace_entry_t *entry)
+/*
+ * Point encoding
+ */
+
+#define HK_TRACE_TAG_NUM 0       // Numeric value delta, same decimals
+#define HK_TRACE_TAG_NUM_DEC 1   // Numeric value delta, followed by new decimals
+#define HK_TRACE_TAG_TEXT 2      // Text value, length in upper bits
+
+#define HK_TRACE_NUM_DIGITS 17   // Maximum number of digits in numeric values
+
+#define HK_TRACE_POINT_MAXSIZE (10 + 10 + 10 + 1 + HK_TRACE_VALUE_MAX)
+
+/* Only accept numbers that are formatted back to the very same string */
+static int hk_trace_parse_num(char *str, long long *pm, int *pd)
 {
-        entry->t = 0;
+        char *s = str;
+        int neg = 0;
+        long long m = 0;
+        int digits = 0;
+        int d = 0;
+
+        if (*s == '-') {
+                neg = 1;
+                s++;
+        }
+
+        if ((*s < '0') || (*s > '9')) {
+                return 0;
+        }
+
+        /* No leading zero */
+        if ((s[0] == '0') && (s[1] >= '0') && (s[1] <= '9')) {
+                return 0;
+        }
+
+        while ((*s >= '0') && (*s <= '9')) {
+                if (++digits > HK_TRACE_NUM_DIGITS) {
+                        return 0;
+                }
+                m = (m * 10) + (*(s++) - '0');
+        }
+
+        if (*s == '.') {
+                s++;
+                if ((*s < '0') || (*s > '9')) {
+                        return 0;
+                }
+                while ((*s >= '0') && (*s <= '9')) {
+                        if (++digits > HK_TRACE_NUM_DIGITS) {
+                                return 0;
+                        }
+                        m = (m * 10) + (*(s++) - '0');
+                        d++;
+                }
+        }
+
+        if (*s != '\0') {
+                return 0;
+        }
 
-        if (entry->value != NULL) {
-                free(entry->value);
-                entry->value = NULL;
+        /* No negative zero */
+        if (neg) {
+                if (m == 0) {
+                        return 0;
+                }
+                m = -m;
         }
 
+        *pm = m;
+        *pd = d;
+
         return 1;
 }
 
 
-void hk_trace_clear(hk_trace_t *tr)
+static int hk_trace_encode(hk_trace_state_t *st, uint64_t t, unsigned long long seq, char *value, unsigned char *ptr)
+{
+        int64_t dt = t - st->t;
+        long long m;
+        int d;
+        int len;
+
+        len = buf_put_varint(ptr, BUF_ZIGZAG(dt - st->dt));
+        st->t = t;
+        st->dt = dt;
+
+        len += buf_put_varint(ptr+len, seq - st->seq - 1);
+        st->seq = seq;
+
+        if (hk_trace_parse_num(value, &m, &d)) {
+                unsigned long long u = BUF_ZIGZAG(m - st->m) << 2;
+
+                if (d != st->d) {
+                        len += buf_put_varint(ptr+len, u | HK_TRACE_TAG_NUM_DEC);
+                        ptr[len++] = d;
+                }
+                else {
+                        len += buf_put_varint(ptr+len, u | HK_TRACE_TAG_NUM);
+                }
+
+                st->m = m;
+                st->d = d;
+        }
+        else {
+                int size = strlen(value);
+
+                if (size > HK_TRACE_VALUE_MAX) {
+                        size = HK_TRACE_VALUE_MAX;
+                }
+
+                len += buf_put_varint(ptr+len, (size << 2) | HK_TRACE_TAG_TEXT);
+                memcpy(ptr+len, value, size);
+                len += size;
+        }
+
+        return len;
+}
+
+
+static int hk_trace_decode(hk_trace_state_t *st, unsigned char *ptr, int size, hk_trace_point_t *pt)
+{
+        unsigned long long u;
+        int len;
+
+        len = buf_parse_varint(ptr, size, &u);
+        st->dt += BUF_UNZIGZAG(u);
+        st->t += st->dt;
+        pt->t = st->t;
+
+        len += buf_parse_varint(ptr+len, size-len, &u);
+        st->seq += u + 1;
+        pt->seq = st->seq;
+
+        len += buf_parse_varint(ptr+len, size-len, &u);
+
+        switch (u & 3) {
+        case HK_TRACE_TAG_NUM_DEC:
+                st->d = ptr[len++];
+                /* Fall through */
+        case HK_TRACE_TAG_NUM:
+                st->m += BUF_UNZIGZAG(u >> 2);
+                pt->numeric = 1;
+                pt->m = st->m;
+                pt->d = st->d;
+                pt->text = NULL;
+                pt->len = 0;
+                break;
+        default:
+                pt->numeric = 0;
+                pt->text = (char *) ptr+len;
+                pt->len = u >> 2;
+                len += pt->len;
+                break;
+        }
+
+        return len;
+}
+
+
+static void hk_trace_state_init(hk_trace_state_t *st, uint64_t t0, unsigned long long seq0)
+{
+        st->t = t0;
+        st->dt = 0;
+        st->seq = seq0 - 1;
+        st->m = 0;
+        st->d = 0;
+}
+
+
+/*
+ * Block ring
+ */
+
+static int hk_trace_grow(hk_trace_t *tr)
 {
+        int nmax = hk_trace_nblocks(tr->depth, HK_TRACE_POINT_SIZE_MAX);
+        int nblocks = tr->nblocks * 2;
+        hk_trace_block_t *blocks;
         int i;
 
-        tr->iput = 0;
+        if (nblocks > nmax) {
+                nblocks = nmax;
+        }
+
+        if (nblocks <= tr->nblocks) {
+                return 0;
+        }
+
+        blocks = malloc(nblocks * sizeof(hk_trace_block_t));
+        if (blocks == NULL) {
+                return 0;
+        }
+
+        /* Unwrap ring, oldest block first */
+        for (i = 0; i < tr->bcount; i++) {
+                blocks[i] = tr->blocks[(tr->bfirst + i) % tr->nblocks];
+        }
+
+        free(tr->blocks);
+        tr->blocks = blocks;
+        tr->nblocks = nblocks;
+        tr->bfirst = 0;
+
+        return 1;
+}
+
 
-        for (i = 0; i < tr->depth; i++) {
-                hk_trace_clear_entry(&tr->tab[i]);
+static hk_trace_block_t *hk_trace_block_new(hk_trace_t *tr, uint64_t t0, unsigned long long seq0)
+{
+        hk_trace_block_t *block;
+
+        /* If all blocks are in use, grow the ring if dropping the oldest block
+           would leave less than depth points. Otherwise drop the oldest block */
+        if ((tr->bcount >= tr->nblocks) && ((tr->count - tr->blocks[tr->bfirst].npoints) < tr->depth)) {
+                hk_trace_grow(tr);
+        }
+
+        if (tr->bcount >= tr->nblocks) {
+                tr->count -= tr->blocks[tr->bfirst].npoints;
+                tr->dropped = tr->blocks[tr->bfirst].st.seq;
+                tr->bfirst = (tr->bfirst + 1) % tr->nblocks;
+                tr->bcount--;
         }
+
+        block = &tr->blocks[(tr->bfirst + tr->bcount) % tr->nblocks];
+        tr->bcount++;
+
+        block->t0 = t0;
+        block->seq0 = seq0;
+        hk_trace_state_init(&block->st, t0, seq0);
+        block->npoints = 0;
+        block->len = 0;
+
+        return block;
 }
 
 
 void hk_trace_push(hk_trace_t *tr, char *value)
 {
-        hk_trace_entry_t *entry = &tr->tab[tr->iput++];
+        uint64_t t = tstamp_ms();
+        unsigned long long seq = ++hk_trace_seq_last;
+        hk_trace_block_t *block = NULL;
+        hk_trace_state_t st;
+        unsigned char ptr[HK_TRACE_POINT_MAXSIZE];
+        int len = 0;
+
+        /* Try to append point to current block */
+        if (tr->bcount > 0) {
+                block = &tr->blocks[(tr->bfirst + tr->bcount - 1) % tr->nblocks];
 
-        hk_trace_clear_entry(entry);
-        entry->t = tstamp_ms();
-        entry->value = strdup(value);
+                if (block->npoints < HK_TRACE_BLOCK_POINTS) {
+                        st = block->st;
+                        len = hk_trace_encode(&st, t, seq, value, ptr);
+                        if (len > (HK_TRACE_BLOCK_SIZE - block->len)) {
+                                block = NULL;
+                        }
+                }
+                else {
+                        block = NULL;
+                }
+        }
 
-        if (tr->iput >= tr->depth) {
-                tr->iput = 0;
+        /* Otherwise start a new block */
+        if (block == NULL) {
+                block = hk_trace_block_new(tr, t, seq);
+                st = block->st;
+                len = hk_trace_encode(&st, t, seq, value, ptr);
         }
 
-        if (tr->iput == tr->iget) {
-                tr->iget++;
-                if (tr->iget >= tr->depth) {
-                        tr->iget = 0;
+        memcpy(&block->data[block->len], ptr, len);
+        block->len += len;
+        block->st = st;
+        block->npoints++;
+        tr->count++;
+        tr->seq = seq;
+}
+
+
+/*
+ * Point iterator
+ */
+
+void hk_trace_iter_init(hk_trace_iter_t *it, hk_trace_t *tr)
+{
+        int skip = tr->count - tr->depth;
+
+        memset(it, 0, sizeof(hk_trace_iter_t));
+        it->tr = tr;
+
+        /* Skip points exceeding trace depth */
+        while ((skip-- > 0) && hk_trace_iter_next(it));
+}
+
+
+/* Move iterator to the block that holds the last point before time stamp t
+   (or the first point, if none), so that following points can be walked
+   from there without decoding the whole trace */
+void hk_trace_iter_seek(hk_trace_iter_t *it, uint64_t t)
+{
+        hk_trace_t *tr = it->tr;
+        int lo = it->iblock;
+        int hi = tr->bcount - 1;
+        int found = -1;
+
+        /* Binary search of last block starting before t */
+        while (lo <= hi) {
+                int mid = (lo + hi) / 2;
+
+                if (tr->blocks[(tr->bfirst + mid) % tr->nblocks].t0 < t) {
+                        found = mid;
+                        lo = mid + 1;
+                }
+                else {
+                        hi = mid - 1;
                 }
         }
 
+        if (found >= 0) {
+                it->iblock = found;
+                it->block = NULL;
+        }
 }
 
 
-void hk_trace_dump(hk_trace_t *tr, uint64_t t1, uint64_t t2, buf_t *out_buf)
+/* Move iterator to the block that holds the point following sequence number seq */
+void hk_trace_iter_seek_seq(hk_trace_iter_t *it, unsigned long long seq)
 {
-        hk_trace_entry_t *pre = NULL;
-        hk_trace_entry_t *last = NULL;
-        int i;
+        hk_trace_t *tr = it->tr;
+        int lo = it->iblock;
+        int hi = tr->bcount - 1;
+        int found = -1;
 
-        i = tr->iget;
-        while (i != tr->iput) {
-                hk_trace_entry_t *entry = &tr->tab[i++];
-                if (i >= tr->depth) {
-                        i = 0;
+        /* Binary search of last block starting at or before seq */
+        while (lo <= hi) {
+                int mid = (lo + hi) / 2;
+
+                if (tr->blocks[(tr->bfirst + mid) % tr->nblocks].seq0 <= seq) {
+                        found = mid;
+                        lo = mid + 1;
+                }
+                else {
+                        hi = mid - 1;
                 }
+        }
 
-                if (entry->value == NULL) {
-                        break;
+        if (found >= 0) {
+                it->iblock = found;
+                it->block = NULL;
+        }
+}
+
+
+int hk_trace_iter_next(hk_trace_iter_t *it)
+{
+        hk_trace_t *tr = it->tr;
+        hk_trace_block_t *block = it->block;
+
+        while ((block == NULL) || (it->ipoint >= block->npoints)) {
+                if (it->iblock >= tr->bcount) {
+                        return 0;
                 }
 
-                if ((t1 == 0) || (entry->t >= t1)) {
-                        if ((t2 == 0) || (entry->t <= t2)) {
-                                if (last == NULL) {
+                block = &tr->blocks[(tr->bfirst + it->iblock) % tr->nblocks];
+                it->block = block;
+                it->iblock++;
+                it->ipoint = 0;
+                it->ofs = 0;
+                hk_trace_state_init(&it->st, block->t0, block->seq0);
+        }
+
+        it->ofs += hk_trace_decode(&it->st, &block->data[it->ofs], block->len - it->ofs, &it->pt);
+        it->ipoint++;
+
+        return 1;
+}
+
+
+void hk_trace_point_append(hk_trace_point_t *pt, buf_t *out_buf)
+{
+        char str[HK_TRACE_NUM_DIGITS + 4];
+        unsigned long long m;
+        int len;
+        int i;
+
+        if (!pt->numeric) {
+                buf_append(out_buf, (unsigned char *) pt->text, pt->len);
+                return;
+        }
+
+        if (pt->m < 0) {
+                buf_append_byte(out_buf, '-');
+                m = -pt->m;
+        }
+        else {
+                m = pt->m;
+        }
+
+        /* Format mantissa digits, with enough leading zeros to insert the decimal point */
+        len = snprintf(str, sizeof(str), "%0*llu", pt->d + 1, m);
+
+        if (pt->d > 0) {
+                i = len - pt->d;
+                buf_append(out_buf, (unsigned char *) str, i);
+                buf_append_byte(out_buf, '.');
+                buf_append(out_buf, (unsigned char *) str+i, pt->d);
+        }
+        else {
+                buf_append(out_buf, (unsigned char *) str, len);
+        }
+}
+
+
+void hk_trace_dump(hk_trace_t *tr, uint64_t t1, uint64_t t2, int max, buf_t *out_buf)
+{
+        hk_trace_iter_t it;
+        hk_trace_point_t pre;
+        hk_trace_point_t last;
+        int has_pre = 0;
+        int has_last = 0;
+        int n = 0;
+
+        hk_trace_iter_init(&it, tr);
+        if (t1 > 0) {
+                hk_trace_iter_seek(&it, t1);
+        }
+
+        while (hk_trace_iter_next(&it)) {
+                hk_trace_point_t *pt = &it.pt;
+
+                if ((t1 == 0) || (pt->t >= t1)) {
+                        if ((t2 == 0) || (pt->t <= t2)) {
+                                if (!has_last) {
                                         buf_append_str(out_buf, tr->name);
                                 }
 
-                                if (pre != NULL) {
-                                        if (pre != entry) {
-                                                buf_append_fmt(out_buf, " %llu,%s", t1, pre->value);
-                                        }
-                                        pre = NULL;
+                                if (has_pre) {
+                                        buf_append_fmt(out_buf, " %llu,", t1);
+                                        hk_trace_point_append(&pre, out_buf);
+                                        has_pre = 0;
                                 }
 
-                                buf_append_fmt(out_buf, " %llu,%s", entry->t, entry->value);
-                                last = entry;
+                                /* Stop when maximum number of points is reached:
+                                   next points are retrieved by requesting the following time range.
+                                   Points at t1 were already sent by the previous request and are
+                                   not counted, so that paging moves forward even if more than
+                                   max points share the same time stamp */
+                                if ((max > 0) && (n >= max) && (pt->t > t1)) {
+                                        buf_append_str(out_buf, "\n");
+                                        has_last = 0;
+                                        break;
+                                }
+
+                                buf_append_fmt(out_buf, " %llu,", pt->t);
+                                hk_trace_point_append(pt, out_buf);
+                                last = *pt;
+                                has_last = 1;
+                                if (pt->t > t1) {
+                                        n++;
+                                }
                         }
                         else {
-                                if (last != NULL) {
-                                        buf_append_fmt(out_buf, " %llu,%s\n", t2, last->value);
-                                        last = NULL;
+                                if (has_last) {
+                                        buf_append_fmt(out_buf, " %llu,", t2);
+                                        hk_trace_point_append(&last, out_buf);
+                                        buf_append_str(out_buf, "\n");
+                                        has_last = 0;
                                 }
                                 break;
                         }
                 }
                 else {
-                        pre = entry;
+                        pre = *pt;
+                        has_pre = 1;
                 }
         }
 
-        if (last != NULL) {
+        if (has_last) {
                 uint64_t t = tstamp_ms();
-                buf_append_fmt(out_buf, " +%llu,%s\n", t, last->value);
+                buf_append_fmt(out_buf, " +%llu,", t);
+                hk_trace_point_append(&last, out_buf);
+                buf_append_str(out_buf, "\n");
+        }
+}
+
+
+/*
+ * Downsampled dump: the time range is split into buckets, each one
+ * reporting its minimum and maximum numeric values (or its first point if
+ * it holds text values only), so that charts keep their peaks whatever
+ * the trace depth.
+ */
+
+typedef struct {
+        int n;                   // Number of points in bucket
+        hk_trace_point_t first;
+        hk_trace_point_t min;
+        hk_trace_point_t max;
+        int numeric;
+} hk_trace_bucket_t;
+
+static const double hk_trace_pow10[HK_TRACE_NUM_DIGITS + 1] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8,
+        1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+};
+
+
+static inline double hk_trace_point_value(hk_trace_point_t *pt)
+{
+        return ((double) pt->m) / hk_trace_pow10[pt->d];
+}
+
+
+static void hk_trace_bucket_add(hk_trace_bucket_t *bucket, hk_trace_point_t *pt)
+{
+        if (bucket->n == 0) {
+                bucket->first = *pt;
+        }
+        bucket->n++;
+
+        if (pt->numeric) {
+                double v = hk_trace_point_value(pt);
+
+                if (!bucket->numeric) {
+                        bucket->min = *pt;
+                        bucket->max = *pt;
+                        bucket->numeric = 1;
+                }
+                else if (v < hk_trace_point_value(&bucket->min)) {
+                        bucket->min = *pt;
+                }
+                else if (v > hk_trace_point_value(&bucket->max)) {
+                        bucket->max = *pt;
+                }
         }
 }
+
+
+static void hk_trace_bucket_flush(hk_trace_bucket_t *bucket, buf_t *out_buf)
+{
+        hk_trace_point_t *pt1 = &bucket->first;
+        hk_trace_point_t *pt2 = NULL;
+
+        if (bucket->n == 0) {
+                return;
+        }
+
+        /* Dump min and max values in time order */
+        if (bucket->numeric) {
+                if (bucket->min.t <= bucket->max.t) {
+                        pt1 = &bucket->min;
+                        pt2 = &bucket->max;
+                }
+                else {
+                        pt1 = &bucket->max;
+                        pt2 = &bucket->min;
+                }
+        }
+
+        buf_append_fmt(out_buf, " %llu,", pt1->t);
+        hk_trace_point_append(pt1, out_buf);
+
+        if ((pt2 != NULL) && ((pt2->t != pt1->t) || (pt2->m != pt1->m) || (pt2->d != pt1->d))) {
+                buf_append_fmt(out_buf, " %llu,", pt2->t);
+                hk_trace_point_append(pt2, out_buf);
+        }
+
+        memset(bucket, 0, sizeof(hk_trace_bucket_t));
+}
+
+
+void hk_trace_dump_sampled(hk_trace_t *tr, uint64_t t1, uint64_t t2, int points, buf_t *out_buf)
+{
+        hk_trace_iter_t it;
+        hk_trace_point_t pre;
+        hk_trace_point_t last;
+        hk_trace_bucket_t bucket;
+        int has_pre = 0;
+        int has_last = 0;
+        int stopped = 0;
+        int nbuckets = (points > 1) ? (points / 2) : 1;
+        int ibucket = -1;
+        uint64_t t0 = t1;
+        uint64_t tn = (t2 > 0) ? t2 : tstamp_ms();
+
+        memset(&bucket, 0, sizeof(bucket));
+
+        hk_trace_iter_init(&it, tr);
+        if (t1 > 0) {
+                hk_trace_iter_seek(&it, t1);
+        }
+
+        while (hk_trace_iter_next(&it)) {
+                hk_trace_point_t *pt = &it.pt;
+                int i;
+
+                if ((t1 > 0) && (pt->t < t1)) {
+                        pre = *pt;
+                        has_pre = 1;
+                        continue;
+                }
+
+                if ((t2 > 0) && (pt->t > t2)) {
+                        stopped = 1;
+                        break;
+                }
+
+                if (!has_last) {
+                        buf_append_str(out_buf, tr->name);
+
+                        if (has_pre) {
+                                buf_append_fmt(out_buf, " %llu,", t1);
+                                hk_trace_point_append(&pre, out_buf);
+                        }
+                        else if (t0 == 0) {
+                                t0 = pt->t;
+                        }
+                }
+
+                /* Move to bucket holding this point */
+                if (tn > t0) {
+                        i = ((pt->t - t0) * nbuckets) / (tn - t0 + 1);
+                }
+                else {
+                        i = 0;
+                }
+
+                if (i != ibucket) {
+                        hk_trace_bucket_flush(&bucket, out_buf);
+                        ibucket = i;
+                }
+
+                hk_trace_bucket_add(&bucket, pt);
+                last = *pt;
+                has_last = 1;
+        }
+
+        if (has_last) {
+                hk_trace_bucket_flush(&bucket, out_buf);
+
+                /* Extend last value to end of range */
+                if (stopped) {
+                        buf_append_fmt(out_buf, " %llu,", t2);
+                }
+                else {
+                        buf_append_fmt(out_buf, " +%llu,", tstamp_ms());
+                }
+                hk_trace_point_append(&last, out_buf);
+                buf_append_str(out_buf, "\n");
+        }
+}
+
+
+/*
+ * Incremental dump: points recorded after sequence number seq.
+ * Returns -1 (and dumps nothing) if some of these points were already
+ * dropped from the trace, so that the caller can send a full dump instead.
+ */
+
+int hk_trace_dump_since(hk_trace_t *tr, unsigned long long seq, buf_t *out_buf)
+{
+        hk_trace_iter_t it;
+        int n = 0;
+
+        if (tr->seq <= seq) {
+                return 0;
+        }
+
+        /* Check for points lost by ring overrun */
+        if (tr->dropped > seq) {
+                return -1;
+        }
+
+        hk_trace_iter_init(&it, tr);
+        if ((it.block != NULL) && (it.pt.seq > seq)) {
+                return -1;
+        }
+
+        hk_trace_iter_seek_seq(&it, seq);
+
+        while (hk_trace_iter_next(&it)) {
+                hk_trace_point_t *pt = &it.pt;
+
+                if (pt->seq > seq) {
+                        if (n == 0) {
+                                buf_append_str(out_buf, "+");
+                                buf_append_str(out_buf, tr->name);
+                        }
+
+                        buf_append_fmt(out_buf, " %llu,", pt->t);
+                        hk_trace_point_append(pt, out_buf);
+                        n++;
+                }
+        }
+
+        if (n > 0) {
+                buf_append_str(out_buf, "\n");
+        }
+
+        return n;
+}
@@ -0,0 +1,225 @@
+/*
+ * HAKit - The Home Automation KIT - www.hakit.net
+ * Copyright (C) 2014-2017 Sylvain Giroudon
+ *
+ * Trace storage benchmark.
+ * Measures push throughput and memory footprint of the trace storage,
+ * compared with the former implementation that kept one strdup'ed
+ * string per point.
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "tstamp.h"
+#include "log.h"
+#include "buf.h"
+#include "trace.h"
+
+#define BENCH_NTRACES 200
+#define BENCH_DEPTH 2000
+#define BENCH_ROUNDS 5     // Pushes per trace, in multiples of depth
+
+
+/* Log to stderr, without linking the whole logging gears */
+void log_str(const char *fmt, ...)
+{
+        va_list ap;
+
+        va_start(ap, fmt);
+        vfprintf(stderr, fmt, ap);
+        va_end(ap);
+        fputc('\n', stderr);
+}
+
+
+/*
+ * Former trace storage: ring of time stamps and strdup'ed values
+ */
+
+typedef struct {
+        uint64_t t;
+        char *value;
+} ref_entry_t;
+
+typedef struct {
+        int depth;
+        int iget;
+        int iput;
+        ref_entry_t *tab;
+} ref_trace_t;
+
+
+static void ref_trace_init(ref_trace_t *tr, int depth)
+{
+        tr->depth = depth;
+        tr->iget = 0;
+        tr->iput = 0;
+        tr->tab = calloc(depth, sizeof(ref_entry_t));
+}
+
+
+static void ref_trace_push(ref_trace_t *tr, char *value)
+{
+        ref_entry_t *entry = &tr->tab[tr->iput++];
+
+        free(entry->value);
+        entry->t = tstamp_us();
+        entry->value = strdup(value);
+
+        if (tr->iput >= tr->depth) {
+                tr->iput = 0;
+        }
+
+        if (tr->iput == tr->iget) {
+                tr->iget++;
+                if (tr->iget >= tr->depth) {
+                        tr->iget = 0;
+                }
+        }
+}
+
+
+/*
+ * Benchmark
+ */
+
+typedef enum {
+        BENCH_CURRENT=0,
+        BENCH_REFERENCE,
+} bench_impl_t;
+
+static char *bench_impl_names[] = { "current", "strdup" };
+
+
+static long bench_rss_kb(void)
+{
+        FILE *f = fopen("/proc/self/statm", "r");
+        long size = 0;
+        long rss = 0;
+
+        if (f != NULL) {
+                if (fscanf(f, "%ld %ld", &size, &rss) != 2) {
+                        rss = 0;
+                }
+                fclose(f);
+        }
+
+        return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+
+static void bench_value(char *value, int i, int text)
+{
+        static char *states[] = { "idle", "heating", "cooling", "off" };
+
+        if (text) {
+                strcpy(value, states[(i / 7) % 4]);
+        }
+        else {
+                sprintf(value, "%d.%d", 20 + (i % 5), i % 7);
+        }
+}
+
+
+static void bench_run(bench_impl_t impl, int ntraces, int depth, int text)
+{
+        hk_trace_t *trs = NULL;
+        ref_trace_t *refs = NULL;
+        struct timespec t1, t2;
+        char value[32];
+        long rss0 = bench_rss_kb();
+        long npush = 0;
+        int count = 0;
+        double dt;
+        int i, j;
+
+        if (impl == BENCH_REFERENCE) {
+                refs = calloc(ntraces, sizeof(ref_trace_t));
+                for (j = 0; j < ntraces; j++) {
+                        ref_trace_init(&refs[j], depth);
+                }
+        }
+        else {
+                trs = calloc(ntraces, sizeof(hk_trace_t));
+                for (j = 0; j < ntraces; j++) {
+                        hk_trace_init(&trs[j], "bench", depth);
+                }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        for (i = 0; i < (BENCH_ROUNDS * depth); i++) {
+                bench_value(value, i, text);
+                for (j = 0; j < ntraces; j++) {
+                        if (impl == BENCH_REFERENCE) {
+                                ref_trace_push(&refs[j], value);
+                        }
+                        else {
+                                hk_trace_push(&trs[j], value);
+                        }
+                        npush++;
+                }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t2);
+        dt = (t2.tv_sec - t1.tv_sec) + ((t2.tv_nsec - t1.tv_nsec) / 1e9);
+
+        /* Number of points actually kept */
+        if (impl == BENCH_REFERENCE) {
+                count = depth - 1;
+        }
+        else {
+                hk_trace_iter_t it;
+                hk_trace_iter_init(&it, &trs[0]);
+                while (hk_trace_iter_next(&it)) {
+                        count++;
+                }
+        }
+
+        printf("%-8s %s values: %.1f Mpush/s, RSS +%ld kB, %d/%d points kept\n",
+               bench_impl_names[impl], text ? "text" : "numeric",
+               npush / dt / 1e6, bench_rss_kb() - rss0, count, depth);
+}
+
+
+int main(int argc, char *argv[])
+{
+        int ntraces = (argc > 1) ? atoi(argv[1]) : BENCH_NTRACES;
+        int depth = (argc > 2) ? atoi(argv[2]) : BENCH_DEPTH;
+        int text;
+        int impl;
+
+        printf("%d traces of depth %d, %d x depth pushes each\n", ntraces, depth, BENCH_ROUNDS);
+        fflush(stdout);
+
+        /* Run each case in a separate process, so that memory footprints do not mix up */
+        for (text = 0; text <= 1; text++) {
+                for (impl = BENCH_CURRENT; impl <= BENCH_REFERENCE; impl++) {
+                        pid_t pid = fork();
+
+                        if (pid == 0) {
+                                bench_run(impl, ntraces, depth, text);
+                                exit(0);
+                        }
+                        else if (pid > 0) {
+                                waitpid(pid, NULL, 0);
+                        }
+                        else {
+                                perror("fork");
+                                return 1;
+                        }
+                }
+        }
+
+        return 0;
+}
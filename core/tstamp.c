@@ -17,30 +17,53 @@
 #include "tstamp.h"
 
 
+/* Time stamps are taken from the monotonic clock, so that they are
+   not affected by wall clock steps (NTP, manual setting, ...).
+   The wall clock time of the monotonic origin is kept for display. */
+static uint64_t _tstamp_origin = 0;
 static uint64_t _tstamp_t0 = 0;
 
 
-static inline uint64_t tstamp_ms_abs(void)
+static inline uint64_t tstamp_us_abs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (((uint64_t) ts.tv_sec) * 1000000) + (ts.tv_nsec / 1000);
+}
+
+
+static void tstamp_init(void)
 {
 	struct timeval t;
 
 	gettimeofday(&t, NULL);
-        return (((uint64_t) t.tv_sec) * 1000) + (t.tv_usec / 1000);
+	_tstamp_origin = tstamp_us_abs();
+	_tstamp_t0 = (((uint64_t) t.tv_sec) * 1000) + (t.tv_usec / 1000);
 }
 
 
 uint64_t tstamp_t0(void)
 {
         if (_tstamp_t0 == 0) {
-                _tstamp_t0 = tstamp_ms_abs();
+                tstamp_init();
         }
         return _tstamp_t0;
 }
 
 
+uint64_t tstamp_us(void)
+{
+        if (_tstamp_t0 == 0) {
+                tstamp_init();
+        }
+        return tstamp_us_abs() - _tstamp_origin;
+}
+
+
 uint64_t tstamp_ms(void)
 {
-        return tstamp_ms_abs() - tstamp_t0();
+        return tstamp_us() / 1000;
 }
 
 
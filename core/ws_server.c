@@ -157,21 +157,14 @@ void ws_alias(ws_server_t *server, char *location, char *dir)
 
 int ws_session_add(ws_server_t *server, void *pss)
 {
-	void **ppss = NULL;
+	void **ppss;
 	int i;
 
 	server->salt++;
 	server->salt &= 0xFF;
 
-	for (i = 0; i < server->sessions.nmemb; i++) {
-		ppss = HK_TAB_PTR(server->sessions, void *, i);
-		if (*ppss == NULL) {
-			goto done;
-		}
-	}
-
-	ppss = hk_tab_push(&server->sessions);
-done:
+	i = hk_tab_alloc(&server->sessions);
+	ppss = HK_TAB_PTR(server->sessions, void *, i);
 	*ppss = pss;
 
 	return (server->salt << 8) + (i & 0xFF);
@@ -187,6 +180,7 @@ void ws_session_remove(ws_server_t *server, void *pss)
 		ppss = HK_TAB_PTR(server->sessions, void *, i);
 		if (*ppss == pss) {
 			*ppss = NULL;
+			hk_tab_release(&server->sessions, i);
 		}
 	}
 }
@@ -31,7 +31,7 @@ include $(HAKIT_DIR)tools/check.mk
 #
 
 CFLAGS  = -Wall -fPIC -I$(HAKIT_DIR)utils/include -I$(HAKIT_DIR)os/include -I$(HAKIT_DIR)core/include
-LDFLAGS = -lpthread
+LDFLAGS = -lpthread -lrt
 SOFLAGS =
 
 ifdef DEBUG
@@ -138,6 +138,13 @@ CFLAGS += -DWITH_SSL
 LDFLAGS += -lssl -lcrypto
 endif
 
+#
+# Event loop backend (poll() is used as fallback)
+#
+ifneq ($(WITHOUT_EPOLL),yes)
+CFLAGS += -DWITH_EPOLL
+endif
+
 #
 # Standard cross-compile SDK path
 #
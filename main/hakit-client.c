@@ -13,6 +13,7 @@
 #include "log.h"
 #include "sys.h"
 #include "tcpio.h"
+#include "line.h"
 
 #include "hakit_version.h"
 
@@ -41,8 +42,9 @@ static const options_entry_t options_entries[] = {
 tcp_sock_t tcp_sock;
 buf_t tcp_buf;
 io_channel_t stdin_chan;
+int exit_code = 0;
 
-static void tcp_recv_line(char *str)
+static void tcp_recv_line(void *user_data, char *str, int len)
 {
         printf("%s\n", str);
 }
@@ -50,45 +52,13 @@ static void tcp_recv_line(char *str)
 
 static void tcp_recv(char *rbuf, int rsize)
 {
-	int i;
-
 	log_debug(2, "tcp_recv rsize=%d", rsize);
 
 	if (rsize <= 0) {
 		return;
 	}
 
-	i = 0;
-	while (i < rsize) {
-		int i0 = i;
-
-		/* Search end-of-line delimiter */
-		while ((i < rsize) && (rbuf[i] != '\n')) {
-			i++;
-		}
-
-		// If newline character reached, process this line
-		if (i < rsize) {
-			char *str = &rbuf[i0];
-			int len = i - i0;
-
-			rbuf[i++] = '\0';
-
-			if (tcp_buf.len > 0) {
-				buf_append(&tcp_buf, (unsigned char *) str, len);
-				str = (char *) tcp_buf.base;
-				len = tcp_buf.len;
-				tcp_buf.len = 0;
-			}
-
-			if (len > 0) {
-				tcp_recv_line(str);
-			}
-		}
-		else {
-			buf_append(&tcp_buf, (unsigned char *) &rbuf[i0], i-i0);
-		}	
-	}
+	line_split(&tcp_buf, rbuf, rsize, tcp_recv_line, NULL);
 }
 
 
@@ -98,7 +68,14 @@ static void tcp_event(tcp_sock_t *tcp_sock, tcp_io_t io, char *rbuf, int rsize)
 
 	switch (io) {
 	case TCP_IO_CONNECT:
-		log_debug(2, "  CONNECT %s", rbuf);
+		if (rbuf == NULL) {
+			log_debug(2, "  CONNECT failed");
+			exit_code = 2;
+			sys_quit();
+		}
+		else {
+			log_debug(2, "  CONNECT %s", rbuf);
+		}
 		break;
 	case TCP_IO_DATA:
 		log_debug(2, "  DATA %d", rsize);
@@ -109,6 +86,9 @@ static void tcp_event(tcp_sock_t *tcp_sock, tcp_io_t io, char *rbuf, int rsize)
 		log_debug(2, "  HUP");
                 sys_quit();
 		break;
+	case TCP_IO_DRAIN:
+		log_debug(2, "  DRAIN");
+		break;
 	default:
 		log_debug(2, "  PANIC: unknown event caught");
 		break;
@@ -171,5 +151,5 @@ int main(int argc, char *argv[])
 
 	sys_run();
 
-	return 0;
+	return exit_code;
 }
@@ -44,7 +44,14 @@ static char *opt_certs = NULL;
 static int opt_no_mqtt = 0;
 static char *opt_mqtt_broker = NULL;
 static int opt_trace_depth = 0;
+static int opt_stats = 0;
 extern int opt_full_name;
+extern int opt_hkcp_lowat;
+extern int opt_hkcp_hiwat;
+extern char *opt_hkcp_policy;
+extern int opt_hkcp_retries;
+extern int opt_hkcp_retry_min;
+extern int opt_hkcp_retry_max;
 
 static const options_entry_t options_entries[] = {
 	{ "debug",        'd', OPTION_FLAG_NONE, OPTIONS_TYPE_INT,    &opt_debug,        "Set debug level", "N" },
@@ -53,6 +60,13 @@ static const options_entry_t options_entries[] = {
 	{ "class-path",   'C', OPTION_FLAG_LIST, OPTIONS_TYPE_STRING, &opt_class_path,   "Comma-separated list of class directory pathes", "DIRS" },
 	{ "trace-depth",  't', OPTION_FLAG_NONE, OPTIONS_TYPE_INT,    &opt_trace_depth,  "Set trace recording depth for user interface charts.", "DEPTH" },
 	{ "full-name",    'f', OPTION_FLAG_NONE, OPTIONS_TYPE_NONE,   &opt_full_name,    "Use fully qualified endpoint names. Do not connect local sinks/sources together." },
+	{ "hkcp-hiwat",   '\0', OPTION_FLAG_NONE, OPTIONS_TYPE_INT,   &opt_hkcp_hiwat,   "Set HKCP peer output buffer high watermark (0 = unlimited)", "BYTES" },
+	{ "hkcp-lowat",   '\0', OPTION_FLAG_NONE, OPTIONS_TYPE_INT,   &opt_hkcp_lowat,   "Set HKCP peer output buffer low watermark (default: high watermark / 4)", "BYTES" },
+	{ "hkcp-policy",  '\0', OPTION_FLAG_NONE, OPTIONS_TYPE_STRING, &opt_hkcp_policy,  "Set HKCP slow peer policy: coalesce (default), drop, disconnect", "POLICY" },
+	{ "hkcp-retries", '\0', OPTION_FLAG_NONE, OPTIONS_TYPE_INT,   &opt_hkcp_retries, "Set HKCP node connection attempts before giving up (default: 4)", "N" },
+	{ "hkcp-retry-min", '\0', OPTION_FLAG_NONE, OPTIONS_TYPE_INT, &opt_hkcp_retry_min, "Set HKCP node connection retry initial delay (default: 2000)", "MS" },
+	{ "hkcp-retry-max", '\0', OPTION_FLAG_NONE, OPTIONS_TYPE_INT, &opt_hkcp_retry_max, "Set HKCP node connection retry maximum delay (default: 60000)", "MS" },
+	{ "stats",        '\0', OPTION_FLAG_NONE, OPTIONS_TYPE_NONE,  &opt_stats,        "Collect event loop statistics from startup (default: from first 'stats' command)" },
 #ifdef WITH_SSL
 	{ "no-https",     's', OPTION_FLAG_NONE, OPTIONS_TYPE_NONE,   &opt_no_https,     "Use HTTP instead of HTTPS" },
 	{ "insecure",     'k', OPTION_FLAG_NONE, OPTIONS_TYPE_NONE,   &opt_insecure_ssl, "Allow insecure HTTP TLS/SSL for client connections (self-signed certificates)" },
@@ -96,6 +110,9 @@ int main(int argc, char *argv[])
 
 	/* Init system runtime */
 	sys_init();
+	if (opt_stats) {
+		sys_stats_enable();
+	}
 
 	/* Init communication engine */
 	if (opt_no_https) {
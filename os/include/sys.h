@@ -13,6 +13,8 @@
 #include <sys/types.h>
 #include <poll.h>
 
+#include "buf.h"
+
 typedef unsigned int sys_tag_t;
 typedef int (*sys_func_t)(void *arg);
 typedef int (*sys_io_func_t)(void *arg, int fd);
@@ -32,7 +34,16 @@ extern sys_tag_t sys_quit_handler(sys_func_t func, void *arg);
 extern void sys_remove(sys_tag_t tag);
 extern void sys_remove_fd(int fd);
 
+/* Invoke a function from the sys_run() loop. May be called from any thread.
+   Returns -1 if the function could not be queued. */
+extern int sys_post(sys_func_t func, void *arg);
+
 extern void sys_run(void);
 extern void sys_quit(void);
 
+/* Event loop statistics. Not collected until enabled. */
+extern void sys_stats_enable(void);
+extern void sys_stats_reset(void);
+extern void sys_stats_dump(buf_t *out_buf);
+
 #endif /* __HAKIT_SYS_H__ */
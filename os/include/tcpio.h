@@ -13,6 +13,7 @@
 #include <netinet/in.h>
 
 #include "buf.h"
+#include "ring.h"
 #include "io.h"
 
 /*
@@ -28,12 +29,14 @@
  */
 
 typedef enum {
-	TCP_IO_CONNECT=0,
+	TCP_IO_CONNECT=0,  // Connection established (rbuf = remote address), or failed (rbuf = NULL)
 	TCP_IO_DATA,
-	TCP_IO_HUP
+	TCP_IO_HUP,
+	TCP_IO_DRAIN,      // Write buffer below low watermark, after congestion or drain request
 } tcp_io_t;
 
 typedef struct tcp_sock_s tcp_sock_t;
+typedef struct tcp_resolve_s tcp_resolve_t;
 
 typedef void (* tcp_func_t)(tcp_sock_t *tcp_sock, tcp_io_t io, char *rbuf, int rsize);
 
@@ -41,7 +44,13 @@ struct tcp_sock_s {
 	io_channel_t chan;
 	tcp_func_t func;
 	void *user_data;
-        buf_t wbuf;
+        ring_t wbuf;
+        int lowat;         // Write buffer low watermark
+        int hiwat;         // Write buffer high watermark (0 = unlimited)
+        int congested;
+        int drain_req;
+        int connecting;    // Outgoing connection in progress
+        tcp_resolve_t *resolve;  // Pending host name resolution
 #ifdef WITH_SSL
         SSL_CTX *ssl_ctx;
         SSL *ssl;
@@ -56,6 +65,9 @@ extern int tcp_sock_connect(tcp_sock_t *tcp_sock, char *host, int port, char *ce
 			    tcp_func_t func, void *user_data);
 extern int tcp_sock_is_connected(tcp_sock_t *tcp_sock);
 extern void tcp_sock_write(tcp_sock_t *tcp_sock, char *buf, int size);
+extern void tcp_sock_set_watermarks(tcp_sock_t *tcp_sock, int lowat, int hiwat);
+extern int tcp_sock_is_congested(tcp_sock_t *tcp_sock);
+extern void tcp_sock_request_drain(tcp_sock_t *tcp_sock);
 extern void tcp_sock_shutdown(tcp_sock_t *tcp_sock);
 
 
@@ -63,11 +75,10 @@ extern void tcp_sock_shutdown(tcp_sock_t *tcp_sock);
  * TCP Server
  */
 
-#define TCP_SRV_MAX_CLIENTS 32
-
 typedef struct {
 	tcp_sock_t csock;
-	tcp_sock_t dsock[TCP_SRV_MAX_CLIENTS];
+	tcp_sock_t **dsock;     // Table of client data sockets, grown on demand
+	int ndsock;
 	struct sockaddr_in iremote;
 	tcp_func_t func;
 	void *user_data;
@@ -10,11 +10,20 @@
 #define _GNU_SOURCE
 
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
 #include <malloc.h>
 #include <poll.h>
-#include <sys/time.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#ifdef WITH_EPOLL
+#include <sys/epoll.h>
+#endif
 #include <sys/types.h>
 #include <sys/wait.h>
 
@@ -24,7 +33,15 @@
 #include "sys.h"
 
 
-#define NSOURCES 256
+/* Sources are allocated by slabs, so that their addresses remain stable */
+#define SYS_SLAB_SHIFT 6
+#define SYS_SLAB_SIZE (1 << SYS_SLAB_SHIFT)
+
+/* A tag is made of the source slot index and the slot generation number */
+#define SYS_TAG_INDEX_BITS 16
+#define SYS_TAG_INDEX_MASK ((1 << SYS_TAG_INDEX_BITS) - 1)
+#define SYS_TAG_GEN_MAX (0xFFFFFFFFU >> SYS_TAG_INDEX_BITS)
+#define SYS_MAX_SOURCES (1 << SYS_TAG_INDEX_BITS)
 
 typedef enum {
 	SYS_TYPE_NONE=0,
@@ -38,6 +55,9 @@ typedef enum {
 
 typedef struct {
 	sys_tag_t tag;
+	unsigned int index;   // Slot index in source table
+	unsigned int gen;     // Slot generation, incremented each time the slot is freed
+	int next;             // Next slot in free or removed list (-1 = none)
 	sys_func_t func;
 	sys_io_func_t wfunc;
 	void *arg;
@@ -46,53 +66,447 @@ typedef struct {
 		struct {
 			struct pollfd pollfd;
 			int poll;
+			int registered;   // Registered to the epoll set
+			int unpollable;   // Not supported by epoll (e.g. regular file)
 		} io;
 		struct {
 			unsigned long delay;
 			unsigned long long t;
+			unsigned long seq;  // Insertion order, for timers with the same deadline
+			int heap_pos;     // Position in timer heap (1-based, 0 = not queued)
 		} timeout;
 		struct {
 			pid_t pid;
 			int status;
+			int hnext;        // Next slot index (+1) in pid hash chain
 		} child;
 	} d;
 } sys_source_t;
 
 
-static sys_tag_t last_tag = 0;
 static volatile int quit_requested = 0;
-static sys_source_t sources[NSOURCES] = {};
+static volatile int sys_sigchld_pending = 0;
+static int sys_sigchld_fd = -1;
+static int sys_sigchld_unblock = 0;
+
+static sys_source_t **sys_slabs = NULL;
+static int sys_nslots = 0;
+static int sys_free_head = -1;
+static int sys_free_tail = -1;
+static int sys_removed_head = -1;
 
+/* IO source slot index (+1) for each file descriptor */
+static int *sys_fds = NULL;
+static int sys_fds_size = 0;
 
-static void sys_source_clear(sys_source_t *src)
+
+static inline sys_source_t *sys_slot(int index)
 {
-	memset(src, 0, sizeof(sys_source_t));
+	return &sys_slabs[index >> SYS_SLAB_SHIFT][index & (SYS_SLAB_SIZE - 1)];
 }
 
 
-static sys_source_t *sys_source_add(sys_func_t func, void *arg)
+/*
+ * IO event backend
+ */
+
+#ifdef WITH_EPOLL
+
+#define SYS_EPOLL_MAXEVENTS 64
+
+static int sys_epoll_fd = -1;
+static int sys_epoll_failed = 0;
+static int sys_io_unpollable = 0;
+
+
+static int sys_epoll_init(void)
 {
-	sys_source_t *src = NULL;
-	int i;
+	if (sys_epoll_fd >= 0) {
+		return 0;
+	}
+
+	if (sys_epoll_failed) {
+		return -1;
+	}
+
+	sys_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (sys_epoll_fd < 0) {
+		log_str("WARNING: epoll_create1: %s -- falling back to poll()", strerror(errno));
+		sys_epoll_failed = 1;
+		return -1;
+	}
+
+	log_debug(2, "sys_epoll_init => fd=%d", sys_epoll_fd);
+
+	return 0;
+}
+
+
+static int sys_epoll_ctl(int op, sys_source_t *src)
+{
+	struct epoll_event ev = {};
+
+	/* POLLxxx and EPOLLxxx event bits have the same values on Linux */
+	ev.events = src->d.io.pollfd.events & (EPOLLIN | EPOLLPRI | EPOLLOUT | EPOLLRDHUP | EPOLLERR | EPOLLHUP);
+	ev.data.u64 = src->tag;
+
+	return epoll_ctl(sys_epoll_fd, op, src->d.io.pollfd.fd, &ev);
+}
+
+
+static void sys_io_update(sys_source_t *src)
+{
+	int ret;
+
+	if (sys_epoll_init()) {
+		return;
+	}
+
+	if (src->d.io.unpollable) {
+		return;
+	}
+
+	if (src->d.io.registered) {
+		ret = sys_epoll_ctl(EPOLL_CTL_MOD, src);
+		if ((ret < 0) && (errno == ENOENT)) {
+			/* File descriptor was closed and reopened behind our back */
+			ret = sys_epoll_ctl(EPOLL_CTL_ADD, src);
+		}
+	}
+	else {
+		ret = sys_epoll_ctl(EPOLL_CTL_ADD, src);
+		if ((ret < 0) && (errno == EEXIST)) {
+			ret = sys_epoll_ctl(EPOLL_CTL_MOD, src);
+		}
+	}
+
+	if (ret == 0) {
+		src->d.io.registered = 1;
+	}
+	else if (errno == EPERM) {
+		/* Regular files and directories are always ready: poll them by hand */
+		log_debug(3, "sys_io_update(%d): fd not supported by epoll", src->d.io.pollfd.fd);
+		src->d.io.unpollable = 1;
+		sys_io_unpollable++;
+	}
+	else {
+		log_str("PANIC: epoll_ctl(%d): %s", src->d.io.pollfd.fd, strerror(errno));
+	}
+}
+
+
+static void sys_epoll_release(sys_source_t *src)
+{
+	if (src->d.io.registered) {
+		/* Failure is harmless here: fd may already be closed */
+		epoll_ctl(sys_epoll_fd, EPOLL_CTL_DEL, src->d.io.pollfd.fd, NULL);
+		src->d.io.registered = 0;
+	}
+
+	if (src->d.io.unpollable) {
+		src->d.io.unpollable = 0;
+		sys_io_unpollable--;
+	}
+}
+
+#else /* WITH_EPOLL */
+
+static inline void sys_io_update(sys_source_t *src) {}
+static inline void sys_epoll_release(sys_source_t *src) {}
+
+#endif /* !WITH_EPOLL */
+
+
+/*
+ * Timer heap
+ */
 
-	/* Try to spot a free slot */
-	for (i = 0; i < NSOURCES; i++) {
-		if (sources[i].tag == 0) {
-			src = &sources[i];
+typedef struct {
+	sys_source_t **tab;
+	int size;
+	int n;
+} sys_timer_heap_t;
+
+static sys_timer_heap_t sys_timers = {};
+static unsigned long sys_timer_seq = 0;
+
+
+static inline int sys_timer_before(sys_source_t *src1, sys_source_t *src2)
+{
+	if (src1->d.timeout.t == src2->d.timeout.t) {
+		/* Same deadline: fire in order of insertion */
+		return ((long) (src1->d.timeout.seq - src2->d.timeout.seq) < 0);
+	}
+
+	return (src1->d.timeout.t < src2->d.timeout.t);
+}
+
+
+static inline void sys_timer_heap_set(int i, sys_source_t *src)
+{
+	sys_timers.tab[i] = src;
+	src->d.timeout.heap_pos = i + 1;
+}
+
+
+static void sys_timer_heap_up(int i)
+{
+	sys_source_t *src = sys_timers.tab[i];
+
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (!sys_timer_before(src, sys_timers.tab[parent])) {
 			break;
 		}
+		sys_timer_heap_set(i, sys_timers.tab[parent]);
+		i = parent;
 	}
 
-	/* Allocate a new slot if none is available */
-	if (src == NULL) {
-		log_str("PANIC: No more system sources available");
-		return NULL;
+	sys_timer_heap_set(i, src);
+}
+
+
+static void sys_timer_heap_down(int i)
+{
+	sys_source_t *src = sys_timers.tab[i];
+
+	for (;;) {
+		int child = (2 * i) + 1;
+		if (child >= sys_timers.n) {
+			break;
+		}
+		if (((child + 1) < sys_timers.n) && sys_timer_before(sys_timers.tab[child+1], sys_timers.tab[child])) {
+			child++;
+		}
+		if (!sys_timer_before(sys_timers.tab[child], src)) {
+			break;
+		}
+		sys_timer_heap_set(i, sys_timers.tab[child]);
+		i = child;
+	}
+
+	sys_timer_heap_set(i, src);
+}
+
+
+static void sys_timer_insert(sys_source_t *src)
+{
+	if (sys_timers.n >= sys_timers.size) {
+		sys_timers.size = sys_timers.size ? (sys_timers.size * 2) : 64;
+		sys_timers.tab = realloc(sys_timers.tab, sys_timers.size * sizeof(sys_source_t *));
+	}
+
+	src->d.timeout.seq = sys_timer_seq++;
+	sys_timers.tab[sys_timers.n] = src;
+	sys_timers.n++;
+	sys_timer_heap_up(sys_timers.n - 1);
+}
+
+
+static void sys_timer_cancel(sys_source_t *src)
+{
+	int i = src->d.timeout.heap_pos - 1;
+
+	if (i < 0) {
+		return;
+	}
+
+	src->d.timeout.heap_pos = 0;
+	sys_timers.n--;
+
+	/* Move last timer to the hole, and restore heap order */
+	if (i < sys_timers.n) {
+		sys_timers.tab[i] = sys_timers.tab[sys_timers.n];
+		sys_timer_heap_up(i);
+		sys_timer_heap_down(sys_timers.tab[i]->d.timeout.heap_pos - 1);
+	}
+}
+
+
+static inline sys_source_t *sys_timer_first(void)
+{
+	return (sys_timers.n > 0) ? sys_timers.tab[0] : NULL;
+}
+
+
+/*
+ * Child process sources, hashed by pid
+ */
+
+#define SYS_CHILD_BUCKETS 64
+
+static int sys_child_buckets[SYS_CHILD_BUCKETS];  // First slot index (+1) of each chain
+
+
+static inline int *sys_child_bucket(pid_t pid)
+{
+	return &sys_child_buckets[pid & (SYS_CHILD_BUCKETS - 1)];
+}
+
+
+static void sys_child_link(sys_source_t *src)
+{
+	int *head = sys_child_bucket(src->d.child.pid);
+
+	src->d.child.hnext = *head;
+	*head = src->index + 1;
+}
+
+
+static void sys_child_unlink(sys_source_t *src)
+{
+	int *pnext = sys_child_bucket(src->d.child.pid);
+
+	while (*pnext != 0) {
+		sys_source_t *src2 = sys_slot(*pnext - 1);
+		if (src2 == src) {
+			*pnext = src->d.child.hnext;
+			break;
+		}
+		pnext = &src2->d.child.hnext;
+	}
+}
+
+
+static sys_source_t *sys_child_retrieve(pid_t pid)
+{
+	int index = *sys_child_bucket(pid);
+
+	while (index != 0) {
+		sys_source_t *src = sys_slot(index - 1);
+		if (src->d.child.pid == pid) {
+			return src;
+		}
+		index = src->d.child.hnext;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Source table
+ */
+
+static void sys_fd_set(int fd, sys_source_t *src)
+{
+	if (fd < 0) {
+		return;
+	}
+
+	if (fd >= sys_fds_size) {
+		int size = sys_fds_size ? sys_fds_size : 64;
+		while (size <= fd) {
+			size *= 2;
+		}
+		sys_fds = realloc(sys_fds, size * sizeof(int));
+		memset(&sys_fds[sys_fds_size], 0, (size - sys_fds_size) * sizeof(int));
+		sys_fds_size = size;
+	}
+
+	sys_fds[fd] = src->index + 1;
+}
+
+
+static void sys_io_release(sys_source_t *src)
+{
+	int fd;
+
+	if (src->type != SYS_TYPE_IO) {
+		return;
+	}
+
+	fd = src->d.io.pollfd.fd;
+	if ((fd >= 0) && (fd < sys_fds_size) && (sys_fds[fd] == (src->index + 1))) {
+		sys_fds[fd] = 0;
+	}
+
+	sys_epoll_release(src);
+}
+
+
+static void sys_source_free_push(sys_source_t *src)
+{
+	src->next = -1;
+	if (sys_free_tail >= 0) {
+		sys_slot(sys_free_tail)->next = src->index;
+	}
+	else {
+		sys_free_head = src->index;
+	}
+	sys_free_tail = src->index;
+}
+
+
+static int sys_source_grow(void)
+{
+	sys_source_t *slab;
+	int nslabs = sys_nslots / SYS_SLAB_SIZE;
+	int i;
+
+	if ((sys_nslots + SYS_SLAB_SIZE) > SYS_MAX_SOURCES) {
+		return -1;
+	}
+
+	slab = calloc(SYS_SLAB_SIZE, sizeof(sys_source_t));
+	if (slab == NULL) {
+		return -1;
+	}
+
+	sys_slabs = realloc(sys_slabs, (nslabs + 1) * sizeof(sys_source_t *));
+	sys_slabs[nslabs] = slab;
+
+	for (i = 0; i < SYS_SLAB_SIZE; i++) {
+		sys_source_t *src = &slab[i];
+		src->index = sys_nslots + i;
+		src->gen = 1;
+		sys_source_free_push(src);
 	}
 
-	sys_source_clear(src);
+	sys_nslots += SYS_SLAB_SIZE;
+
+	log_debug(3, "sys_source_grow => %d slots", sys_nslots);
+
+	return 0;
+}
 
-	last_tag++;
-	src->tag = last_tag;
+
+static void sys_source_free(sys_source_t *src)
+{
+	unsigned int index = src->index;
+	unsigned int gen = src->gen + 1;
+
+	memset(src, 0, sizeof(sys_source_t));
+	src->index = index;
+
+	/* Change generation, so that stale tags no longer match this slot */
+	src->gen = (gen > SYS_TAG_GEN_MAX) ? 1 : gen;
+
+	sys_source_free_push(src);
+}
+
+
+static sys_source_t *sys_source_add(sys_func_t func, void *arg)
+{
+	sys_source_t *src;
+
+	/* Allocate a new slab if no free slot is available */
+	if (sys_free_head < 0) {
+		if (sys_source_grow()) {
+			log_str("PANIC: No more system sources available");
+			return NULL;
+		}
+	}
+
+	/* Pick the oldest free slot, to delay generation wrap-around */
+	src = sys_slot(sys_free_head);
+	sys_free_head = src->next;
+	if (sys_free_head < 0) {
+		sys_free_tail = -1;
+	}
+
+	src->next = -1;
+	src->tag = (src->gen << SYS_TAG_INDEX_BITS) | src->index;
 	src->func = func;
 	src->arg = arg;
 
@@ -100,18 +514,57 @@ static sys_source_t *sys_source_add(sys_func_t func, void *arg)
 }
 
 
+static void sys_source_remove(sys_source_t *src)
+{
+	if (src->type == SYS_TYPE_REMOVED) {
+		return;
+	}
+
+	sys_io_release(src);
+	if (src->type == SYS_TYPE_TIMEOUT) {
+		sys_timer_cancel(src);
+	}
+	else if (src->type == SYS_TYPE_CHILD) {
+		sys_child_unlink(src);
+	}
+
+	src->type = SYS_TYPE_REMOVED;
+	src->func = NULL;
+	src->wfunc = NULL;
+	src->arg = NULL;
+
+	/* Slot will be released before the next poll */
+	src->next = sys_removed_head;
+	sys_removed_head = src->index;
+}
+
+
+static void sys_source_release_removed(void)
+{
+	while (sys_removed_head >= 0) {
+		sys_source_t *src = sys_slot(sys_removed_head);
+		sys_removed_head = src->next;
+		log_debug(4, "sys_run/1: REMOVED tag=%u", src->tag);
+		sys_source_free(src);
+	}
+}
+
+
 static sys_source_t *sys_retrieve(sys_tag_t tag)
 {
-	int i;
+	unsigned int index = tag & SYS_TAG_INDEX_MASK;
+	sys_source_t *src;
 
-	for (i = 0; i < NSOURCES; i++) {
-		sys_source_t *src = &sources[i];
-		if (src->tag == tag) {
-                        return src;
-		}
+	if ((tag == 0) || (index >= sys_nslots)) {
+		return NULL;
 	}
 
-	return NULL;
+	src = sys_slot(index);
+	if (src->tag != tag) {
+		return NULL;
+	}
+
+	return src;
 }
 
 
@@ -121,26 +574,25 @@ void sys_remove(sys_tag_t tag)
 
         sys_source_t *src = sys_retrieve(tag);
         if (src != NULL) {
-                src->type = SYS_TYPE_REMOVED;
-                src->func = NULL;
-                src->wfunc = NULL;
-                src->arg = NULL;
+                sys_source_remove(src);
         }
 }
 
 
 static sys_source_t *sys_retrieve_fd(int fd)
 {
-	int i;
+	sys_source_t *src;
 
-	for (i = 0; i < NSOURCES; i++) {
-		sys_source_t *src = &sources[i];
-		if ((src->type == SYS_TYPE_IO) && (src->d.io.pollfd.fd == fd)) {
-			return src;
-		}
+	if ((fd < 0) || (fd >= sys_fds_size) || (sys_fds[fd] == 0)) {
+		return NULL;
 	}
 
-	return NULL;
+	src = sys_slot(sys_fds[fd] - 1);
+	if ((src->type != SYS_TYPE_IO) || (src->d.io.pollfd.fd != fd)) {
+		return NULL;
+	}
+
+	return src;
 }
 
 
@@ -151,23 +603,23 @@ void sys_remove_fd(int fd)
 	log_debug(3, "sys_remove_fd(%d)", fd);
 
 	if (src != NULL) {
-		src->type = SYS_TYPE_REMOVED;
-		src->func = NULL;
-		src->arg = NULL;
+		sys_source_remove(src);
 	}
 }
 
 
+/* Timers are scheduled from the monotonic clock, so that deadlines
+   are not affected by wall clock steps */
 static unsigned long long sys_now(void)
 {
-	struct timeval tv;
+	struct timespec ts;
 
-	if (gettimeofday(&tv, NULL) < 0) {
-		log_str("PANIC: gettimeofday: %s", strerror(errno));
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+		log_str("PANIC: clock_gettime: %s", strerror(errno));
 		return 0;
 	}
 
-	return (((unsigned long long) tv.tv_sec) * 1000) + (tv.tv_usec / 1000);
+	return (((unsigned long long) ts.tv_sec) * 1000) + (ts.tv_nsec / 1000000);
 }
 
 
@@ -196,6 +648,8 @@ sys_tag_t sys_io_watch(int fd, sys_io_func_t func, void *arg)
 	src->d.io.pollfd.events = POLLIN | POLLPRI | POLLRDHUP | POLLERR | POLLHUP | POLLNVAL;
 	src->d.io.pollfd.revents = 0;
 	src->d.io.poll = 0;
+	sys_fd_set(fd, src);
+	sys_io_update(src);
 
 	log_debug(3, "sys_io_watch(%d) => tag=%u", fd, src->tag);
 	return src->tag;
@@ -206,7 +660,7 @@ int sys_io_write_handler(sys_tag_t tag, sys_io_func_t wfunc)
 {
         sys_source_t *src = sys_retrieve(tag);
 
-	if (src == NULL) {
+	if ((src == NULL) || (src->type != SYS_TYPE_IO)) {
 		return -1;
 	}
 
@@ -218,6 +672,7 @@ int sys_io_write_handler(sys_tag_t tag, sys_io_func_t wfunc)
         }
 
 	src->wfunc = wfunc;
+	sys_io_update(src);
 
         return 0;
 }
@@ -236,6 +691,8 @@ sys_tag_t sys_io_poll(int fd, unsigned int events, sys_poll_func_t func, void *a
 	src->d.io.pollfd.events = events;
 	src->d.io.pollfd.revents = 0;
 	src->d.io.poll = 1;
+	sys_fd_set(fd, src);
+	sys_io_update(src);
 
 	log_debug(3, "sys_io_poll(%d,%02X) => tag=%u", fd, events, src->tag);
 
@@ -254,6 +711,7 @@ sys_tag_t sys_timeout(unsigned long delay, sys_func_t func, void *arg)
 	src->type = SYS_TYPE_TIMEOUT;
 	src->d.timeout.delay = delay;
 	src->d.timeout.t = delay + sys_now();
+	sys_timer_insert(src);
 	log_debug(3, "sys_timeout(%lu) => tag=%u t=%llu", delay, src->tag, src->d.timeout.t);
 	return src->tag;
 }
@@ -269,6 +727,7 @@ sys_tag_t sys_child_watch(pid_t pid, sys_child_func_t func, void *arg)
 
 	src->type = SYS_TYPE_CHILD;
 	src->d.child.pid = pid;
+	sys_child_link(src);
 	log_debug(3, "sys_child_watch(%d) => tag=%u", pid, src->tag);
 	return src->tag;
 }
@@ -288,11 +747,213 @@ sys_tag_t sys_quit_handler(sys_func_t func, void *arg)
 }
 
 
+/*
+ * Event loop statistics
+ */
+
+#define SYS_STATS_HIST_SIZE 24   // Callback duration histogram: log2(us) slots
+#define SYS_STATS_SLOWEST 8      // Number of slowest callbacks to keep
+
+typedef struct {
+	unsigned long count;
+	unsigned long long time;    // Total callback execution time (us)
+	unsigned long long max;     // Longest callback execution time (us)
+	unsigned long hist[SYS_STATS_HIST_SIZE];
+} sys_stats_type_t;
+
+typedef struct {
+	unsigned long count;
+	unsigned long long time;    // us
+	unsigned long long max;     // us
+} sys_stats_time_t;
+
+typedef struct {
+	sys_tag_t tag;
+	sys_type_t type;
+	sys_func_t func;
+	unsigned long long time;    // Callback execution time (us)
+	unsigned long long t;       // When the callback was invoked (ms since statistics start)
+} sys_stats_slow_t;
+
+typedef struct {
+	unsigned long long t0;      // Statistics start time (ms)
+	sys_stats_type_t types[SYS_TYPE_REMOVED];
+	sys_stats_time_t wait;      // Time spent waiting in poll
+	sys_stats_time_t lateness;  // Timer fire time minus deadline
+	sys_stats_slow_t slowest[SYS_STATS_SLOWEST];
+	int nslowest;
+} sys_stats_t;
+
+static sys_stats_t sys_stats = {};
+static int sys_stats_enabled = 0;  // Statistics are only collected once requested
+
+static char *sys_type_names[] = {
+	"NONE", "TIMEOUT", "IO", "CHILD", "QUIT", "REMOVED",
+};
+
+
+static unsigned long long sys_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (((unsigned long long) ts.tv_sec) * 1000000) + (ts.tv_nsec / 1000);
+}
+
+
+static inline void sys_stats_time(sys_stats_time_t *st, unsigned long long dt)
+{
+	st->count++;
+	st->time += dt;
+	if (dt > st->max) {
+		st->max = dt;
+	}
+}
+
+
+static void sys_stats_slow(sys_tag_t tag, sys_type_t type, sys_func_t func,
+			   unsigned long long t, unsigned long long dt)
+{
+	sys_stats_slow_t *slow = sys_stats.slowest;
+	int n = sys_stats.nslowest;
+	int i;
+
+	/* Drop this callback if faster than all recorded ones */
+	if ((n >= SYS_STATS_SLOWEST) && (dt <= slow[n-1].time)) {
+		return;
+	}
+
+	/* Keep only the slowest invocation of each source */
+	for (i = 0; i < n; i++) {
+		if (slow[i].tag == tag) {
+			if (dt <= slow[i].time) {
+				return;
+			}
+			break;
+		}
+	}
+
+	/* Not found: replace the fastest entry */
+	if (i >= n) {
+		if (n < SYS_STATS_SLOWEST) {
+			sys_stats.nslowest = ++n;
+		}
+		i = n - 1;
+	}
+
+	/* Keep table sorted by decreasing execution time */
+	while ((i > 0) && (slow[i-1].time < dt)) {
+		slow[i] = slow[i-1];
+		i--;
+	}
+
+	slow[i].tag = tag;
+	slow[i].type = type;
+	slow[i].func = func;
+	slow[i].time = dt;
+	slow[i].t = (t / 1000) - sys_stats.t0;
+}
+
+
+static void sys_stats_callback(sys_tag_t tag, sys_type_t type, sys_func_t func,
+			       unsigned long long t1, unsigned long long t2)
+{
+	sys_stats_type_t *st = &sys_stats.types[type];
+	unsigned long long dt = t2 - t1;
+	int i = 0;
+
+	st->count++;
+	st->time += dt;
+	if (dt > st->max) {
+		st->max = dt;
+	}
+
+	/* Slot i counts durations in range [2^(i-1), 2^i[ us */
+	while ((dt > 0) && (i < (SYS_STATS_HIST_SIZE - 1))) {
+		dt >>= 1;
+		i++;
+	}
+	st->hist[i]++;
+
+	sys_stats_slow(tag, type, func, t1, t2 - t1);
+}
+
+
+void sys_stats_reset(void)
+{
+	memset(&sys_stats, 0, sizeof(sys_stats));
+	sys_stats.t0 = sys_now_us() / 1000;
+}
+
+
+void sys_stats_enable(void)
+{
+	if (!sys_stats_enabled) {
+		sys_stats_reset();
+		sys_stats_enabled = 1;
+	}
+}
+
+
+void sys_stats_dump(buf_t *out_buf)
+{
+	unsigned long long now = sys_now_us() / 1000;
+	sys_stats_time_t *st;
+	int type;
+	int i;
+
+	buf_append_fmt(out_buf, "period: %llums\n", now - sys_stats.t0);
+	buf_append_fmt(out_buf, "sources: %d slots\n", sys_nslots);
+
+	for (type = SYS_TYPE_TIMEOUT; type < SYS_TYPE_REMOVED; type++) {
+		sys_stats_type_t *stt = &sys_stats.types[type];
+
+		char sep = '=';
+
+		buf_append_fmt(out_buf, "dispatch %s: count=%lu time=%lluus max=%lluus hist",
+			       sys_type_names[type], stt->count, stt->time, stt->max);
+		for (i = 0; i < SYS_STATS_HIST_SIZE; i++) {
+			if (stt->hist[i] > 0) {
+				buf_append_fmt(out_buf, "%c<%lu:%lu", sep, 1UL << i, stt->hist[i]);
+				sep = ',';
+			}
+		}
+		buf_append_str(out_buf, (sep == '=') ? "=\n" : "\n");
+	}
+
+	st = &sys_stats.wait;
+	buf_append_fmt(out_buf, "wait: count=%lu time=%lluus max=%lluus\n", st->count, st->time, st->max);
+
+	st = &sys_stats.lateness;
+	buf_append_fmt(out_buf, "lateness: count=%lu avg=%lluus max=%lluus\n",
+		       st->count, st->count ? (st->time / st->count) : 0, st->max);
+
+	for (i = 0; i < sys_stats.nslowest; i++) {
+		sys_stats_slow_t *slow = &sys_stats.slowest[i];
+		buf_append_fmt(out_buf, "slowest: tag=%u type=%s func=%p time=%lluus t=%llu\n",
+			       slow->tag, sys_type_names[slow->type], slow->func, slow->time, slow->t);
+	}
+}
+
+
 static int sys_callback(sys_source_t *src)
 {
+	sys_tag_t tag = src->tag;
+	sys_type_t type = src->type;
+	sys_func_t func = src->func;
+	unsigned long long t1 = 0;
 	int ret = -1;
 
 	if (src->func != NULL) {
+		if (sys_stats_enabled) {
+			t1 = sys_now_us();
+
+			/* Timer lateness */
+			if ((type == SYS_TYPE_TIMEOUT) && (t1 > (src->d.timeout.t * 1000))) {
+				sys_stats_time(&sys_stats.lateness, t1 - (src->d.timeout.t * 1000));
+			}
+		}
+
 		switch (src->type) {
 		case SYS_TYPE_IO:
 			if (src->d.io.poll) {
@@ -309,8 +970,9 @@ static int sys_callback(sys_source_t *src)
                                                 if (src->wfunc != NULL) {
                                                         cont = ((sys_io_func_t) src->wfunc)(src->arg, src->d.io.pollfd.fd);
                                                 }
-                                                if (cont == 0) {
+                                                if ((cont == 0) && (src->type == SYS_TYPE_IO)) {
                                                         src->d.io.pollfd.events &= ~POLLOUT;
+                                                        sys_io_update(src);
                                                 }
                                         }
                                         ret = 1;
@@ -324,10 +986,14 @@ static int sys_callback(sys_source_t *src)
 			ret = src->func(src->arg);
 			break;
 		}
+
+		if (sys_stats_enabled) {
+			sys_stats_callback(tag, type, func, t1, sys_now_us());
+		}
 	}
 
 	if (ret <= 0) {
-		sys_source_clear(src);
+		sys_source_remove(src);
 	}
 
 	return ret;
@@ -338,23 +1004,18 @@ static void sys_waitpid(void)
 {
 	pid_t pid;
 	int status;
-	int i;
 
 	log_debug(4, "(sys_waitpid)");
 
 	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-		log_debug(3, "sys_waitpid => pid=%d status=%d", pid, status);
+		sys_source_t *src;
 
-		for (i = 0; i < NSOURCES; i++) {
-			sys_source_t *src = &sources[i];
+		log_debug(3, "sys_waitpid => pid=%d status=%d", pid, status);
 
-			if (src->type == SYS_TYPE_CHILD) {
-				if (src->d.child.pid == pid) {
-					src->d.child.status = status;
-					sys_callback(src);
-					sys_source_clear(src);
-				}
-			}
+		while ((src = sys_child_retrieve(pid)) != NULL) {
+			src->d.child.status = status;
+			sys_callback(src);
+			sys_source_remove(src);
 		}
 	}
 
@@ -364,6 +1025,173 @@ static void sys_waitpid(void)
 }
 
 
+static void sys_timer_expire(unsigned long long now)
+{
+	static sys_source_t **expired = NULL;
+	static int expired_size = 0;
+	int nexpired = 0;
+	int i;
+
+	/* Dequeue expired timers first, so that timers (re)armed
+	   by callbacks are not fired before the next loop iteration */
+	while ((sys_timers.n > 0) && (sys_timers.tab[0]->d.timeout.t <= now)) {
+		sys_source_t *src = sys_timers.tab[0];
+
+		sys_timer_cancel(src);
+
+		if (nexpired >= expired_size) {
+			expired_size = expired_size ? (expired_size * 2) : 64;
+			expired = realloc(expired, expired_size * sizeof(sys_source_t *));
+		}
+		expired[nexpired++] = src;
+	}
+
+	for (i = 0; i < nexpired; i++) {
+		sys_source_t *src = expired[i];
+
+		/* Skip timers removed by a previous callback */
+		if (src->type != SYS_TYPE_TIMEOUT) {
+			continue;
+		}
+
+		/* Timer expired => invoke timeout callback, and rearm it if requested */
+		if (sys_callback(src)) {
+			if ((src->type == SYS_TYPE_TIMEOUT) && (src->d.timeout.heap_pos == 0)) {
+				src->d.timeout.t = now + src->d.timeout.delay;
+				sys_timer_insert(src);
+			}
+		}
+	}
+}
+
+
+static int sys_poll_wait(long long timeout)
+{
+	static struct pollfd *fds = NULL;
+	static sys_tag_t *fds_tags = NULL;
+	static int fds_size = 0;
+	unsigned long long t1;
+	int nfds = 0;
+	int status;
+	int i;
+
+	if (fds_size < sys_fds_size) {
+		fds_size = sys_fds_size;
+		fds = realloc(fds, fds_size * sizeof(struct pollfd));
+		fds_tags = realloc(fds_tags, fds_size * sizeof(sys_tag_t));
+	}
+
+	/* Construct poll settings */
+	for (i = 0; i < sys_fds_size; i++) {
+		sys_source_t *src = sys_retrieve_fd(i);
+
+		if (src != NULL) {
+			log_debug(4, "sys_run/1: IO tag=%u", src->tag);
+			src->d.io.pollfd.revents = 0;
+			fds[nfds] = src->d.io.pollfd;
+			fds_tags[nfds] = src->tag;
+			nfds++;
+		}
+	}
+
+	/* Wait for something to happen */
+	log_debug(4, "sys_run/2: poll (timeout=%lld)", timeout);
+	if (sys_stats_enabled) {
+		t1 = sys_now_us();
+		status = poll(fds, nfds, timeout);
+		sys_stats_time(&sys_stats.wait, sys_now_us() - t1);
+	}
+	else {
+		status = poll(fds, nfds, timeout);
+	}
+	log_debug(4, "sys_run/3: poll => status=%d", status);
+
+	if (status > 0) {
+		/* Check io events */
+		for (i = 0; i < nfds; i++) {
+			unsigned int revents = fds[i].revents;
+			sys_source_t *src;
+
+			if (revents == 0) {
+				continue;
+			}
+
+			/* Ignore events from sources removed by a previous callback */
+			src = sys_retrieve(fds_tags[i]);
+			if ((src != NULL) && (src->type == SYS_TYPE_IO)) {
+				log_debug(4, "sys_run/4: IO tag=%d fd=%d revents=%02X", src->tag, src->d.io.pollfd.fd, revents);
+				src->d.io.pollfd.revents = revents;
+				sys_callback(src);
+			}
+		}
+	}
+
+	return status;
+}
+
+
+#ifdef WITH_EPOLL
+
+static int sys_epoll_wait(long long timeout)
+{
+	struct epoll_event events[SYS_EPOLL_MAXEVENTS];
+	unsigned long long t1;
+	int status;
+	int i;
+
+	/* Sources that epoll cannot watch are always ready: do not sleep */
+	if (sys_io_unpollable > 0) {
+		timeout = 0;
+	}
+
+	/* Wait for something to happen */
+	log_debug(4, "sys_run/2: epoll_wait (timeout=%lld)", timeout);
+	if (sys_stats_enabled) {
+		t1 = sys_now_us();
+		status = epoll_wait(sys_epoll_fd, events, SYS_EPOLL_MAXEVENTS, timeout);
+		sys_stats_time(&sys_stats.wait, sys_now_us() - t1);
+	}
+	else {
+		status = epoll_wait(sys_epoll_fd, events, SYS_EPOLL_MAXEVENTS, timeout);
+	}
+	log_debug(4, "sys_run/3: epoll_wait => status=%d", status);
+
+	if (status < 0) {
+		return status;
+	}
+
+	/* Check io events */
+	for (i = 0; i < status; i++) {
+		sys_source_t *src = sys_retrieve(events[i].data.u64);
+
+		/* Ignore events from sources removed by a previous callback */
+		if ((src == NULL) || (src->type != SYS_TYPE_IO)) {
+			continue;
+		}
+
+		log_debug(4, "sys_run/4: IO tag=%d fd=%d revents=%02X", src->tag, src->d.io.pollfd.fd, events[i].events);
+		src->d.io.pollfd.revents = events[i].events & 0xFFFF;
+		sys_callback(src);
+	}
+
+	/* Serve always-ready sources */
+	if (sys_io_unpollable > 0) {
+		for (i = 0; i < sys_fds_size; i++) {
+			sys_source_t *src = sys_retrieve_fd(i);
+
+			if ((src != NULL) && src->d.io.unpollable) {
+				src->d.io.pollfd.revents = src->d.io.pollfd.events & (POLLIN | POLLOUT);
+				sys_callback(src);
+			}
+		}
+	}
+
+	return status;
+}
+
+#endif /* WITH_EPOLL */
+
+
 void sys_run(void)
 {
 	int i;
@@ -372,10 +1200,8 @@ void sys_run(void)
 
 	while (quit_requested == 0) {
 		unsigned long long now;
-		struct pollfd fds[NSOURCES];
-		int fds_lookup[NSOURCES];
-		int nfds = 0;
 		long long timeout = -1;
+		int status;
 
 		now = sys_now();
 		if (now == 0) {
@@ -383,93 +1209,57 @@ void sys_run(void)
 		}
 
 		/* Check timer events */
-		for (i = 0; i < NSOURCES; i++) {
-			sys_source_t *src = &sources[i];
-
-			if (src->type == SYS_TYPE_TIMEOUT) {
-				if (src->d.timeout.t <= now) {
-					/* Timer expired => invoke timeout callback */
-					if (sys_callback(src)) {
-						if (src->type == SYS_TYPE_TIMEOUT) {
-							src->d.timeout.t = now + src->d.timeout.delay;
-						}
-					}
-				}
-			}
-		}
-
-		/* Construct poll settings */
-		for (i = 0; i < NSOURCES; i++) {
-			sys_source_t *src = &sources[i];
+		sys_timer_expire(now);
 
+		/* Do not wait if a timer callback requested to quit */
+		if (quit_requested) {
+			break;
+		}
 
-			fds_lookup[i] = -1;
-
-			if (src->type == SYS_TYPE_TIMEOUT) {
-				log_debug(4, "sys_run/1: TIMEOUT tag=%u %llu %llu", src->tag, src->d.timeout.t, now);
-				if (src->d.timeout.t > now) {
-					unsigned long long dt = src->d.timeout.t - now;
-					if ((timeout < 0) || (dt < timeout)) {
-						timeout = dt;
-					}
-				}
-			}
+		/* Compute poll timeout from the nearest deadline */
+		sys_source_t *first = sys_timer_first();
+		if (first != NULL) {
+			log_debug(4, "sys_run/1: TIMEOUT tag=%u %llu %llu", first->tag, first->d.timeout.t, now);
+			timeout = (first->d.timeout.t > now) ? (first->d.timeout.t - now) : 0;
+		}
 
-			else if (src->type == SYS_TYPE_IO) {
-				log_debug(4, "sys_run/1: IO tag=%u", src->tag);
-				src->d.io.pollfd.revents = 0;
-				fds_lookup[i] = nfds;
-				fds[nfds] = src->d.io.pollfd;
-				nfds++;
-			}
+		/* Release removed sources */
+		sys_source_release_removed();
 
-			else if (src->type == SYS_TYPE_REMOVED) {
-				log_debug(4, "sys_run/1: REMOVED tag=%u", src->tag);
-				sys_source_clear(src);
-			}
+		/* Wait for IO events and process them */
+#ifdef WITH_EPOLL
+		if (sys_epoll_init() == 0) {
+			status = sys_epoll_wait(timeout);
+		}
+		else
+#endif
+		{
+			status = sys_poll_wait(timeout);
 		}
-
-		/* Wait for something to happen */
-		log_debug(4, "sys_run/2: poll (timeout=%ld)", timeout);
-		int status = poll(fds, nfds, timeout);
-		log_debug(4, "sys_run/3: poll => status=%d", status);
 
 		if (status < 0) {
 			if ((errno != EAGAIN) && (errno != EINTR)) {
-				log_str("PANIC: select: %s", strerror(errno));
+				log_str("PANIC: poll: %s", strerror(errno));
 				break;
 			}
 		}
-		else if (status > 0) {
-			/* Check io events */
-			for (i = 0; i < NSOURCES; i++) {
-				sys_source_t *src = &sources[i];
-				int fdsi = fds_lookup[i];
-
-				if ((src->type == SYS_TYPE_IO) && (fdsi >= 0)) {
-					unsigned int revents = fds[fdsi].revents;
-					log_debug(4, "sys_run/4: IO tag=%d fd=%d revents=%02X", src->tag, src->d.io.pollfd.fd, revents);
-					if (revents != 0) {
-						src->d.io.pollfd.revents = revents;
-						sys_callback(src);
-					}
-				}
-			}
-		}
 
-		/* Check for SIGCHLD events */
-		sys_waitpid();
+		/* Check for SIGCHLD events caught by the signal handler */
+		if (sys_sigchld_pending) {
+			sys_sigchld_pending = 0;
+			sys_waitpid();
+		}
 	}
 
 	log_debug(1, "Leaving processing loop");
 
 	if (quit_requested) {
-		for (i = 0; i < NSOURCES; i++) {
-			sys_source_t *src = &sources[i];
+		for (i = 0; i < sys_nslots; i++) {
+			sys_source_t *src = sys_slot(i);
 
 			if (src->type == SYS_TYPE_QUIT) {
 				sys_callback(src);
-				sys_source_clear(src);
+				sys_source_remove(src);
 			}
 		}
 	}
@@ -497,7 +1287,206 @@ static void sys_quit_signal(int sig)
 static void sys_sigchld(int sig)
 {
 	/* Child death will be acknowledged by waitpid(),
-	   as this signal will cause select() to be interrupted (EAGAIN) */
+	   as this signal will cause poll() to be interrupted (EINTR) */
+	sys_sigchld_pending = 1;
+}
+
+
+static int sys_sigchld_read(void *arg, int fd)
+{
+	struct signalfd_siginfo info;
+
+	/* Flush notifications: several child exits may be merged into one */
+	while (read(fd, &info, sizeof(info)) == sizeof(info));
+
+	sys_waitpid();
+
+	return 1;
+}
+
+
+static void sys_sigchld_atfork_child(void)
+{
+	sigset_t mask;
+
+	/* Do not leak the blocked SIGCHLD to child processes */
+	if (sys_sigchld_unblock) {
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGCHLD);
+		sigprocmask(SIG_UNBLOCK, &mask, NULL);
+	}
+}
+
+
+static void sys_sigchld_init(void)
+{
+	sigset_t mask, oldmask;
+
+	if (sys_sigchld_fd >= 0) {
+		return;
+	}
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+
+	/* Catch SIGCHLD through a file descriptor, so that waitpid()
+	   is only invoked when a child process actually terminated */
+	sys_sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sys_sigchld_fd < 0) {
+		log_str("WARNING: signalfd: %s -- falling back to SIGCHLD handler", strerror(errno));
+		return;
+	}
+
+	pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+	sys_sigchld_unblock = !sigismember(&oldmask, SIGCHLD);
+	pthread_atfork(NULL, NULL, sys_sigchld_atfork_child);
+
+	sys_io_watch(sys_sigchld_fd, sys_sigchld_read, NULL);
+
+	/* Some child processes may have terminated before SIGCHLD was blocked */
+	sys_sigchld_pending = 1;
+}
+
+
+/*
+ * Cross-thread task posting:
+ * Tasks are pushed to a lock-free multiple-producer/single-consumer
+ * queue (Dmitry Vyukov's intrusive MPSC algorithm), and the main loop
+ * is woken up through an eventfd.
+ */
+
+typedef struct sys_post_node_s sys_post_node_t;
+
+struct sys_post_node_s {
+	sys_post_node_t *next;
+	sys_func_t func;
+	void *arg;
+};
+
+static sys_post_node_t sys_post_stub = {};
+static sys_post_node_t *sys_post_head = &sys_post_stub;  // Last pushed node (producers side)
+static sys_post_node_t *sys_post_tail = &sys_post_stub;  // Next node to pop (main loop side)
+static int sys_post_signaled = 0;
+static int sys_post_fd = -1;
+
+
+static void sys_post_push(sys_post_node_t *node)
+{
+	sys_post_node_t *prev;
+
+	__atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&sys_post_head, node, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&prev->next, node, __ATOMIC_SEQ_CST);
+}
+
+
+static sys_post_node_t *sys_post_pop(void)
+{
+	sys_post_node_t *tail = sys_post_tail;
+	sys_post_node_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	/* Skip stub node */
+	if (tail == &sys_post_stub) {
+		if (next == NULL) {
+			return NULL;
+		}
+		sys_post_tail = next;
+		tail = next;
+		next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+	}
+
+	if (next != NULL) {
+		sys_post_tail = next;
+		return tail;
+	}
+
+	/* A producer is pushing a node: main loop will be woken up again */
+	if (tail != __atomic_load_n(&sys_post_head, __ATOMIC_SEQ_CST)) {
+		return NULL;
+	}
+
+	/* Last node: put the stub back behind it, so that it can be popped */
+	sys_post_push(&sys_post_stub);
+
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next != NULL) {
+		sys_post_tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
+
+
+static int sys_post_recv(void *arg, int fd)
+{
+	sys_post_node_t *node;
+	uint64_t count;
+
+	if (read(fd, &count, sizeof(count)) < 0) {
+		if ((errno != EAGAIN) && (errno != EINTR)) {
+			log_str("PANIC: Cannot read post event: %s", strerror(errno));
+			return 0;
+		}
+	}
+
+	/* Clear signal flag before popping, so that tasks pushed
+	   from now on will trigger a new wakeup */
+	__atomic_store_n(&sys_post_signaled, 0, __ATOMIC_SEQ_CST);
+
+	while ((node = sys_post_pop()) != NULL) {
+		node->func(node->arg);
+		free(node);
+	}
+
+	return 1;
+}
+
+
+int sys_post(sys_func_t func, void *arg)
+{
+	sys_post_node_t *node;
+
+	if (sys_post_fd < 0) {
+		return -1;
+	}
+
+	node = malloc(sizeof(sys_post_node_t));
+	if (node == NULL) {
+		return -1;
+	}
+
+	node->func = func;
+	node->arg = arg;
+	sys_post_push(node);
+
+	/* Wake up the main loop, unless it is already signaled */
+	if (__atomic_exchange_n(&sys_post_signaled, 1, __ATOMIC_SEQ_CST) == 0) {
+		uint64_t one = 1;
+		if (write(sys_post_fd, &one, sizeof(one)) < 0) {
+			/* Function is queued anyway: it will run on next wakeup */
+			log_str("PANIC: Cannot write post event: %s", strerror(errno));
+			__atomic_store_n(&sys_post_signaled, 0, __ATOMIC_SEQ_CST);
+		}
+	}
+
+	return 0;
+}
+
+
+static void sys_post_init(void)
+{
+	if (sys_post_fd >= 0) {
+		return;
+	}
+
+	sys_post_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (sys_post_fd < 0) {
+		log_str("PANIC: eventfd: %s", strerror(errno));
+		return;
+	}
+
+	sys_io_watch(sys_post_fd, sys_post_recv, NULL);
 }
 
 
@@ -514,5 +1503,14 @@ int sys_init(void)
 	signal(SIGTERM, sys_quit_signal);
 	signal(SIGCHLD, sys_sigchld);
 	signal(SIGPIPE, SIG_IGN);
+
+	sys_sigchld_init();
+	sys_post_init();
+	sys_stats_reset();
+
+#ifdef WITH_EPOLL
+	sys_epoll_init();
+#endif
+
 	return 0;
 }
@@ -8,14 +8,19 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <netdb.h>
+#include <pthread.h>
 
 #include "log.h"
 #include "sys.h"
@@ -24,6 +29,23 @@
 #include "tcpio.h"
 
 static void tcp_sock_read_event(tcp_sock_t *tcp_sock, char *buf, int len);
+static void tcp_sock_drain(tcp_sock_t *tcp_sock);
+static void tcp_sock_write_enable(tcp_sock_t *tcp_sock);
+static int tcp_resolve_done(tcp_resolve_t *resolve);
+static int tcp_resolve_poll(tcp_resolve_t *resolve);
+
+/* Host name resolution request, shared with the resolver thread */
+struct tcp_resolve_s {
+	char *host;
+	int port;
+	struct sockaddr_in iremote;
+	int err;
+	tcp_sock_t *tcp_sock;   // NULL if connection was cancelled
+	int unposted;           // Set by the resolver thread if the result could not be posted
+	sys_tag_t tag;          // Fallback polling of unposted result
+};
+
+#define TCP_RESOLVE_POLL_PERIOD 1000  // Unposted resolution result polling period (ms)
 
 
 /*
@@ -138,6 +160,9 @@ static int tcp_sock_ssl_setup(tcp_sock_t *tcp_sock, int sock, SSL_CTX *ssl_ctx,
                 goto FAILED;
         }
 
+        /* Write buffer may be relocated when growing */
+        SSL_set_mode(tcp_sock->ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
         /* Init SSL state */
         if (server) {
                 SSL_set_accept_state(tcp_sock->ssl);
@@ -164,11 +189,19 @@ static int tcp_sock_ssl_write_event(tcp_sock_t *tcp_sock, int fd)
         log_debug(3, "tcp_sock_ssl_write_event [%d] size=%d", fd, tcp_sock->wbuf.len);
 
         if (tcp_sock->wbuf.len > 0) {
-                int ret = SSL_write(tcp_sock->ssl, tcp_sock->wbuf.base, tcp_sock->wbuf.len);
+                struct iovec iov[2];
+
+                /* Write first contiguous segment: the remaining one (if any)
+                   will be written at next write event */
+                ring_iov(&tcp_sock->wbuf, iov);
+                int ret = SSL_write(tcp_sock->ssl, iov[0].iov_base, iov[0].iov_len);
                 log_debug(3, "SSL_write => %d", ret);
 
                 if (ret >= 0) {
-                        buf_shift(&tcp_sock->wbuf, ret);
+                        ring_consume(&tcp_sock->wbuf, ret);
+
+                        /* Drain notification may push more data */
+                        tcp_sock_drain(tcp_sock);
 
                         if (tcp_sock->wbuf.len > 0) {
                                 cont = 1;
@@ -191,6 +224,10 @@ static int tcp_sock_ssl_write_event(tcp_sock_t *tcp_sock, int fd)
                         }
                 }
         }
+        else {
+                tcp_sock_drain(tcp_sock);
+                cont = (tcp_sock->wbuf.len > 0);
+        }
 
         return cont;
 }
@@ -316,7 +353,16 @@ static void tcp_sock_shutdown_(tcp_sock_t *tcp_sock, int silent)
 
         io_channel_close(&tcp_sock->chan);
 
-        buf_cleanup(&tcp_sock->wbuf);
+        /* Forget pending host name resolution */
+        if (tcp_sock->resolve != NULL) {
+                tcp_sock->resolve->tcp_sock = NULL;
+                tcp_sock->resolve = NULL;
+        }
+
+        ring_cleanup(&tcp_sock->wbuf);
+        tcp_sock->congested = 0;
+        tcp_sock->drain_req = 0;
+        tcp_sock->connecting = 0;
 
 #ifdef WITH_SSL
         tcp_sock_ssl_shutdown(tcp_sock);
@@ -349,6 +395,62 @@ void tcp_sock_clear(tcp_sock_t *tcp_sock)
 	io_channel_clear(&tcp_sock->chan);
 	tcp_sock->func = NULL;
 	tcp_sock->user_data = NULL;
+	tcp_sock->lowat = 0;
+	tcp_sock->hiwat = 0;
+	tcp_sock->congested = 0;
+	tcp_sock->drain_req = 0;
+	tcp_sock->connecting = 0;
+	tcp_sock->resolve = NULL;
+}
+
+
+void tcp_sock_set_watermarks(tcp_sock_t *tcp_sock, int lowat, int hiwat)
+{
+	if (lowat > hiwat) {
+		lowat = hiwat;
+	}
+
+	tcp_sock->lowat = lowat;
+	tcp_sock->hiwat = hiwat;
+}
+
+
+int tcp_sock_is_congested(tcp_sock_t *tcp_sock)
+{
+	if ((tcp_sock->hiwat > 0) && (tcp_sock->wbuf.len >= tcp_sock->hiwat)) {
+		if (!tcp_sock->congested) {
+			log_debug(2, "tcp_sock_is_congested [%d] size=%d", tcp_sock->chan.fd, tcp_sock->wbuf.len);
+			tcp_sock->congested = 1;
+		}
+	}
+
+	return tcp_sock->congested;
+}
+
+
+void tcp_sock_request_drain(tcp_sock_t *tcp_sock)
+{
+	/* Raise a drain event as soon as the socket is writable
+	   and write buffer is below low watermark */
+	if (!tcp_sock->drain_req) {
+		tcp_sock->drain_req = 1;
+		tcp_sock_write_enable(tcp_sock);
+	}
+}
+
+
+static void tcp_sock_drain(tcp_sock_t *tcp_sock)
+{
+	/* Notify user when write buffer gets back below low watermark */
+	if ((tcp_sock->congested || tcp_sock->drain_req) && (tcp_sock->wbuf.len <= tcp_sock->lowat)) {
+		log_debug(2, "tcp_sock_drain [%d] size=%d", tcp_sock->chan.fd, tcp_sock->wbuf.len);
+		tcp_sock->congested = 0;
+		tcp_sock->drain_req = 0;
+
+		if (tcp_sock->func != NULL) {
+			tcp_sock->func(tcp_sock, TCP_IO_DRAIN, NULL, 0);
+		}
+	}
 }
 
 
@@ -373,22 +475,150 @@ static void tcp_sock_setup(tcp_sock_t *tcp_sock, int sock, tcp_func_t func, void
 }
 
 
-int tcp_sock_connect(tcp_sock_t *tcp_sock, char *host, int port, char *certs,
-                     tcp_func_t func, void *user_data)
+/*
+ * Outgoing connection.
+ * Host name resolution, TCP connection and TLS handshake
+ * are driven by the event loop, and never block it.
+ */
+
+static void tcp_sock_connect_failed(tcp_sock_t *tcp_sock)
+{
+        ring_cleanup(&tcp_sock->wbuf);
+        tcp_sock->connecting = 0;
+
+#ifdef WITH_SSL
+        tcp_sock_ssl_shutdown(tcp_sock);
+#endif
+
+	/* Signal connection failure */
+	if (tcp_sock->func != NULL) {
+		tcp_sock->func(tcp_sock, TCP_IO_CONNECT, NULL, 0);
+	}
+}
+
+
+static void tcp_sock_connected(tcp_sock_t *tcp_sock, int sock)
 {
-	struct hostent *hp;
 	struct sockaddr_in iremote;
-	int sock;
-	char s_addr[INET6_ADDRSTRLEN+1];
+	socklen_t size = sizeof(iremote);
+	char s_addr[INET6_ADDRSTRLEN+1] = "";
 
-	log_debug(2, "tcp_sock_connect: host='%s' port=%d", host, port);
+	if (getpeername(sock, (struct sockaddr *) &iremote, &size) == 0) {
+		ip_addr((struct sockaddr *) &iremote, s_addr, sizeof(s_addr));
+	}
+	log_str("Outgoing connection [%d] established to %s:%d", sock, s_addr, ntohs(iremote.sin_port));
 
-	/* Retrieve server address */
-	if ((hp = gethostbyname(host)) == NULL ) {
-		log_str("ERROR: Unknown host name: %s", host);
-		return -1;
+	/* Hook an IO watch on this socket */
+	tcp_sock->connecting = 0;
+	tcp_sock_setup(tcp_sock, sock, tcp_sock->func, tcp_sock->user_data);
+
+	/* Send data written while connection was in progress */
+	if ((tcp_sock->wbuf.len > 0) || tcp_sock->drain_req) {
+		tcp_sock_write_enable(tcp_sock);
+	}
+
+	/* Signal connection */
+	if (tcp_sock->func != NULL) {
+		tcp_sock->func(tcp_sock, TCP_IO_CONNECT, s_addr, strlen(s_addr));
+	}
+}
+
+
+#ifdef WITH_SSL
+
+static int tcp_sock_ssl_handshake_event(tcp_sock_t *tcp_sock, struct pollfd *pollfd)
+{
+	int sock = pollfd->fd;
+	int ret;
+
+	ret = SSL_do_handshake(tcp_sock->ssl);
+	log_debug(3, "SSL_do_handshake [%d] => %d", sock, ret);
+
+	if (ret != 1) {
+		int ssl_error = SSL_get_error(tcp_sock->ssl, ret);
+
+		/* Wait for socket to be ready for the next handshake step */
+		if (ssl_error == SSL_ERROR_WANT_READ) {
+			sys_io_poll(sock, POLLIN, (sys_poll_func_t) tcp_sock_ssl_handshake_event, tcp_sock);
+			return 1;
+		}
+		if (ssl_error == SSL_ERROR_WANT_WRITE) {
+			sys_io_poll(sock, POLLOUT, (sys_poll_func_t) tcp_sock_ssl_handshake_event, tcp_sock);
+			return 1;
+		}
+
+		log_str("ERROR: SSL handshake failed on connection [%d]: %s", sock, ERR_error_string(ERR_get_error(), NULL));
+	}
+
+	sys_remove(tcp_sock->chan.tag);
+	io_channel_clear(&tcp_sock->chan);
+
+	if (ret == 1) {
+		tcp_sock_connected(tcp_sock, sock);
+	}
+	else {
+		close(sock);
+		tcp_sock_connect_failed(tcp_sock);
 	}
 
+	return 0;
+}
+
+#endif /* WITH_SSL */
+
+
+static int tcp_sock_connect_event(tcp_sock_t *tcp_sock, struct pollfd *pollfd)
+{
+	int sock = pollfd->fd;
+	socklen_t size;
+	int err = 0;
+
+	log_debug(2, "tcp_sock_connect_event [%d] revents=%02X", sock, pollfd->revents);
+
+	/* Get connection status */
+	size = sizeof(err);
+	if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &size) == -1) {
+		err = errno;
+	}
+
+	/* Stop watching connection progress */
+	sys_remove(tcp_sock->chan.tag);
+	io_channel_clear(&tcp_sock->chan);
+
+	if (err != 0) {
+		log_str("ERROR: connect [%d]: %s", sock, strerror(err));
+		goto FAILED;
+	}
+
+        /* Setup SSL gears, and start handshake */
+#ifdef WITH_SSL
+        if (tcp_sock->ssl_ctx != NULL) {
+                if (tcp_sock_ssl_setup(tcp_sock, sock, tcp_sock->ssl_ctx, 0) < 0) {
+                        goto FAILED;
+                }
+
+                tcp_sock->chan.fd = sock;
+                tcp_sock->chan.tag = sys_io_poll(sock, POLLOUT, (sys_poll_func_t) tcp_sock_ssl_handshake_event, tcp_sock);
+                return 0;
+        }
+#endif
+
+	tcp_sock_connected(tcp_sock, sock);
+
+	return 0;
+
+FAILED:
+        close(sock);
+	tcp_sock_connect_failed(tcp_sock);
+	return 0;
+}
+
+
+static int tcp_sock_connect_addr(tcp_sock_t *tcp_sock, struct sockaddr_in *iremote)
+{
+	char s_addr[INET6_ADDRSTRLEN+1];
+	int sock;
+
 	/* Create network socket */
 	sock = socket(AF_INET, SOCK_STREAM, 0);
 	if (sock == -1 ) {
@@ -396,43 +626,171 @@ int tcp_sock_connect(tcp_sock_t *tcp_sock, char *host, int port, char *certs,
 		return -1;
 	}
 
+	io_blocking(sock, 0);
+
 	/* Connect to server */
-	iremote.sin_family = AF_INET;
-	memcpy(&iremote.sin_addr.s_addr, hp->h_addr, hp->h_length);
-	iremote.sin_port = htons(port);
+	if (connect(sock, (struct sockaddr *) iremote, sizeof(*iremote)) == -1) {
+		if (errno != EINPROGRESS) {
+			ip_addr((struct sockaddr *) iremote, s_addr, sizeof(s_addr));
+			log_str("ERROR: connect(%s:%d): %s", s_addr, ntohs(iremote->sin_port), strerror(errno));
+			close(sock);
+			return -1;
+		}
+	}
 
-	if (connect(sock, (struct sockaddr *) &iremote, sizeof(iremote)) == -1 ) {
-		log_str("ERROR: connect(%s:%d): %s", host, port, strerror(errno));
-                goto FAILED;
+	/* Wait for connection completion */
+	tcp_sock->chan.fd = sock;
+	tcp_sock->chan.tag = sys_io_poll(sock, POLLOUT, (sys_poll_func_t) tcp_sock_connect_event, tcp_sock);
+
+	return sock;
+}
+
+
+static void *tcp_resolve_thread(tcp_resolve_t *resolve)
+{
+	struct addrinfo hints;
+	struct addrinfo *res = NULL;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	resolve->err = getaddrinfo(resolve->host, NULL, &hints, &res);
+	if (resolve->err == 0) {
+		memcpy(&resolve->iremote, res->ai_addr, sizeof(resolve->iremote));
+		freeaddrinfo(res);
 	}
 
-	/* Signal connection */
-	ip_addr((struct sockaddr *) &iremote, s_addr, sizeof(s_addr));
-	log_str("Outgoing connection [%d] established to %s:%d", sock, s_addr, port);
+	/* Resume connection from the main loop.
+	   If the result cannot be posted, let the main loop pick it up by polling.
+	   The request must not be touched after being handed over */
+	if (sys_post((sys_func_t) tcp_resolve_done, resolve) < 0) {
+		log_str("ERROR: Cannot post host name resolution result");
+		__atomic_store_n(&resolve->unposted, 1, __ATOMIC_RELEASE);
+	}
 
-        /* Setup SSL gears */
+	return NULL;
+}
+
+
+static int tcp_resolve_poll(tcp_resolve_t *resolve)
+{
+	if (__atomic_load_n(&resolve->unposted, __ATOMIC_ACQUIRE)) {
+		resolve->tag = 0;
+		tcp_resolve_done(resolve);
+		return 0;
+	}
+
+	return 1;
+}
+
+
+static int tcp_resolve_done(tcp_resolve_t *resolve)
+{
+	tcp_sock_t *tcp_sock = resolve->tcp_sock;
+
+	log_debug(2, "tcp_resolve_done host='%s' err=%d", resolve->host, resolve->err);
+
+	if (resolve->tag) {
+		sys_remove(resolve->tag);
+		resolve->tag = 0;
+	}
+
+	/* Connect to resolved address, unless connection was cancelled meanwhile */
+	if (tcp_sock != NULL) {
+		tcp_sock->resolve = NULL;
+
+		if (resolve->err != 0) {
+			log_str("ERROR: Unknown host name: %s (%s)", resolve->host, gai_strerror(resolve->err));
+			tcp_sock_connect_failed(tcp_sock);
+		}
+		else {
+			resolve->iremote.sin_port = htons(resolve->port);
+			if (tcp_sock_connect_addr(tcp_sock, &resolve->iremote) < 0) {
+				tcp_sock_connect_failed(tcp_sock);
+			}
+		}
+	}
+
+	free(resolve->host);
+	free(resolve);
+
+	return 0;
+}
+
+
+/* Start a non-blocking connection to a remote server.
+   Connection completion is signaled with event TCP_IO_CONNECT */
+int tcp_sock_connect(tcp_sock_t *tcp_sock, char *host, int port, char *certs,
+                     tcp_func_t func, void *user_data)
+{
+	struct sockaddr_in iremote;
+	tcp_resolve_t *resolve;
+	pthread_attr_t attr;
+	pthread_t thr;
+	int ret;
+
+	log_debug(2, "tcp_sock_connect: host='%s' port=%d", host, port);
+
+        /* Setup SSL context */
         if (certs != NULL) {
 #ifdef WITH_SSL
                 tcp_sock->ssl_ctx = tcp_sock_ssl_ctx(certs, 0);
                 if (tcp_sock->ssl_ctx == NULL) {
-                        goto FAILED;
-                }
-                if (tcp_sock_ssl_setup(tcp_sock, sock, tcp_sock->ssl_ctx, 0) < 0) {
-                        goto FAILED;
+                        return -1;
                 }
 #else
                 log_str("ERROR: TLS/SSL not available");
-                goto FAILED;
+                return -1;
 #endif
         }
 
-	/* Hook an IO watch on this socket */
-	tcp_sock_setup(tcp_sock, sock, func, user_data);
+	tcp_sock->func = func;
+	tcp_sock->user_data = user_data;
+	tcp_sock->connecting = 1;
 
-	return sock;
+	/* Numeric address: connect immediately */
+	memset(&iremote, 0, sizeof(iremote));
+	iremote.sin_family = AF_INET;
+	iremote.sin_port = htons(port);
+
+	if (inet_pton(AF_INET, host, &iremote.sin_addr) == 1) {
+		ret = tcp_sock_connect_addr(tcp_sock, &iremote);
+		if (ret < 0) {
+			goto FAILED;
+		}
+		return ret;
+	}
+
+	/* Resolve host name in a separate thread */
+	resolve = malloc(sizeof(tcp_resolve_t));
+	memset(resolve, 0, sizeof(tcp_resolve_t));
+	resolve->host = strdup(host);
+	resolve->port = port;
+	resolve->tcp_sock = tcp_sock;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thr, &attr, (void *(*)(void *)) tcp_resolve_thread, resolve);
+	pthread_attr_destroy(&attr);
+
+	if (ret != 0) {
+		log_str("ERROR: Cannot create host name resolution thread: %s", strerror(ret));
+		free(resolve->host);
+		free(resolve);
+		goto FAILED;
+	}
+
+	tcp_sock->resolve = resolve;
+	resolve->tag = sys_timeout(TCP_RESOLVE_POLL_PERIOD, (sys_func_t) tcp_resolve_poll, resolve);
+
+	return 0;
 
 FAILED:
-        close(sock);
+        tcp_sock->connecting = 0;
+#ifdef WITH_SSL
+        tcp_sock_ssl_shutdown(tcp_sock);
+#endif
         return -1;
 }
 
@@ -441,6 +799,8 @@ int tcp_sock_is_connected(tcp_sock_t *tcp_sock)
 {
 	if (tcp_sock == NULL)
 		return 0;
+	if (tcp_sock->connecting)
+		return 0;
 	return (tcp_sock->chan.fd >= 0);
 }
 
@@ -452,20 +812,33 @@ static int tcp_sock_write_event(tcp_sock_t *tcp_sock, int fd)
         log_debug(3, "tcp_sock_write_event [%d] size=%d", fd, tcp_sock->wbuf.len);
 
         if (tcp_sock->wbuf.len > 0) {
-                int ret = io_channel_write_async(&tcp_sock->chan, (char *) tcp_sock->wbuf.base, tcp_sock->wbuf.len);
-                log_debug(3, "io_channel_write_async => %d", ret);
+                struct iovec iov[2];
+                int iovcnt = ring_iov(&tcp_sock->wbuf, iov);
+                int ret = writev(fd, iov, iovcnt);
+                log_debug(3, "writev => %d", ret);
 
                 if (ret >= 0) {
-                        buf_shift(&tcp_sock->wbuf, ret);
+                        ring_consume(&tcp_sock->wbuf, ret);
+
+                        /* Drain notification may push more data */
+                        tcp_sock_drain(tcp_sock);
 
                         if (tcp_sock->wbuf.len > 0) {
                                 cont = 1;
                         }
                 }
+                else if ((errno == EAGAIN) || (errno == EINTR)) {
+                        cont = 1;
+                }
                 else {
+                        log_str("ERROR: Socket [%d] write error: %s", fd, strerror(errno));
                         tcp_sock_read_event(tcp_sock, NULL, 0);
                 }
         }
+        else {
+                tcp_sock_drain(tcp_sock);
+                cont = (tcp_sock->wbuf.len > 0);
+        }
 
         log_debug(3, "  => len=%d, cont=%d", tcp_sock->wbuf.len, cont);
 
@@ -473,23 +846,34 @@ static int tcp_sock_write_event(tcp_sock_t *tcp_sock, int fd)
 }
 
 
+static void tcp_sock_write_enable(tcp_sock_t *tcp_sock)
+{
+        /* Writes are enabled once connection is established */
+        if (tcp_sock->connecting) {
+                return;
+        }
+
+#ifdef WITH_SSL
+        if (tcp_sock->ssl != NULL) {
+                sys_io_write_handler(tcp_sock->chan.tag, (sys_io_func_t) tcp_sock_ssl_write_event);
+        }
+        else
+#endif
+        {
+                sys_io_write_handler(tcp_sock->chan.tag, (sys_io_func_t) tcp_sock_write_event);
+        }
+}
+
+
 void tcp_sock_write(tcp_sock_t *tcp_sock, char *buf, int size)
 {
 	if (tcp_sock != NULL) {
                 log_debug(3, "tcp_sock_write [%d] size=%d+%d", tcp_sock->chan.fd, tcp_sock->wbuf.len, size);
 
-                buf_append(&tcp_sock->wbuf, (unsigned char *) buf, size);
+                ring_append(&tcp_sock->wbuf, (unsigned char *) buf, size);
 
                 if (tcp_sock->wbuf.len > 0) {
-#ifdef WITH_SSL
-                        if (tcp_sock->ssl != NULL) {
-                                sys_io_write_handler(tcp_sock->chan.tag, (sys_io_func_t) tcp_sock_ssl_write_event);
-                        }
-                        else
-#endif
-                        {
-                                sys_io_write_handler(tcp_sock->chan.tag, (sys_io_func_t) tcp_sock_write_event);
-                        }
+                        tcp_sock_write_enable(tcp_sock);
                 }
         }
 }
@@ -511,11 +895,40 @@ void *tcp_sock_get_data(tcp_sock_t *tcp_sock)
  * TCP Server
  */
 
+#define TCP_SRV_BACKLOG 64  // Maximum number of pending connections
+
+static tcp_sock_t *tcp_srv_dsock_alloc(tcp_srv_t *srv)
+{
+	tcp_sock_t *dsock;
+	int i;
+
+	/* Find a free entry in data socket table */
+	for (i = 0; i < srv->ndsock; i++) {
+		dsock = srv->dsock[i];
+		if (dsock->chan.fd < 0) {
+			/* Reset write buffer and watermarks left by previous connection */
+			ring_cleanup(&dsock->wbuf);
+			tcp_sock_clear(dsock);
+			return dsock;
+		}
+	}
+
+	/* If none found, allocate a new one */
+	srv->ndsock++;
+	srv->dsock = (tcp_sock_t **) realloc(srv->dsock, srv->ndsock * sizeof(tcp_sock_t *));
+	dsock = malloc(sizeof(tcp_sock_t));
+	memset(dsock, 0, sizeof(tcp_sock_t));
+	tcp_sock_clear(dsock);
+	srv->dsock[srv->ndsock-1] = dsock;
+
+	return dsock;
+}
+
+
 static int tcp_srv_csock_accept(tcp_srv_t *srv)
 {
 	int sock = -1;
 	socklen_t size;
-	int dnum;
         tcp_sock_t *dsock;
 	char s_addr[INET6_ADDRSTRLEN+1];
 
@@ -527,18 +940,8 @@ static int tcp_srv_csock_accept(tcp_srv_t *srv)
 		return -1;
 	}
 
-	/* Find an available data socket */
-	for (dnum = 0; dnum < TCP_SRV_MAX_CLIENTS; dnum++) {
-		if (srv->dsock[dnum].chan.fd < 0)
-			break;
-	}
-
-	if (dnum >= TCP_SRV_MAX_CLIENTS) {
-		log_str("WARNING: Too many connections");
-                goto FAILED;
-	}
-
-        dsock = &srv->dsock[dnum];
+	/* Get an available data socket */
+        dsock = tcp_srv_dsock_alloc(srv);
 
 	/* Prevent child processes from inheriting this socket */
 	fcntl(sock, F_SETFD, FD_CLOEXEC);
@@ -564,11 +967,13 @@ static int tcp_srv_csock_accept(tcp_srv_t *srv)
 
 	return 0;
 
+#ifdef WITH_SSL
 FAILED:
         if (sock >= 0) {
 		close(sock);
         }
         return -1;
+#endif
 }
 
 
@@ -587,15 +992,12 @@ static int tcp_srv_csock_event(tcp_srv_t *srv, int fd)
 
 void tcp_srv_clear(tcp_srv_t *srv)
 {
-	int i;
-
 	srv->func = NULL;
 	srv->user_data = NULL;
 	tcp_sock_clear(&srv->csock);
 
-	for (i = 0; i < TCP_SRV_MAX_CLIENTS; i++) {
-		tcp_sock_clear(&srv->dsock[i]);
-	}
+	srv->dsock = NULL;
+	srv->ndsock = 0;
 }
 
 
@@ -624,8 +1026,8 @@ int tcp_srv_init(tcp_srv_t *srv, int port, char *certs,
                 goto FAILED;
 	}
 
-	/* Listen to network connection (with backlog of maximum 1 pending connection) */
-	if (listen(srv->csock.chan.fd, 1) == -1) {
+	/* Listen to network connection */
+	if (listen(srv->csock.chan.fd, TCP_SRV_BACKLOG) == -1) {
 		log_str("ERROR: listen: %s", strerror(errno));
                 goto FAILED;
 	}
@@ -668,8 +1070,9 @@ void tcp_srv_shutdown(tcp_srv_t *srv)
 	srv->func = NULL;
 	srv->user_data = NULL;
 
-	for (i = 0; i < TCP_SRV_MAX_CLIENTS; i++)
-		tcp_sock_shutdown(&srv->dsock[i]);
+	/* Data socket entries are kept allocated, as clients may still hold references to them */
+	for (i = 0; i < srv->ndsock; i++)
+		tcp_sock_shutdown(srv->dsock[i]);
 
         log_str("Shutting down server connection [%d]", srv->csock.chan.fd);
         tcp_sock_shutdown_(&srv->csock, 1);
@@ -680,8 +1083,8 @@ void tcp_srv_foreach_client(tcp_srv_t *srv, tcp_foreach_func_t func, void *user_
 {
 	int i;
 
-	for (i = 0; i < TCP_SRV_MAX_CLIENTS; i++) {
-		tcp_sock_t *tcp_sock = &srv->dsock[i];
+	for (i = 0; i < srv->ndsock; i++) {
+		tcp_sock_t *tcp_sock = srv->dsock[i];
 		if (tcp_sock->chan.fd >= 0) {
 			if (!func(tcp_sock, user_data)) {
 				break;
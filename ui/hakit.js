@@ -21,6 +21,10 @@ var hakit_sock_timeout;
 var hakit_sock_failures = 0;
 var hakit_props = {};
 var hakit_t0 = 0;
+var hakit_trace_epoch;
+var hakit_trace_seq = 0;
+var hakit_trace_restarted = false;
+var hakit_chart_changed = false;
 
 
 function get_appropriate_ws_url()
@@ -113,7 +117,9 @@ function hakit_recv_get(line)
     if ((typeof hakit_chart_enabled === "function") && hakit_chart_enabled()) {
         let chart_name = chart_args[0];
         if (chart_name != '-') {
-            hakit_chart_add(chart_name, signal_name, chart_args[1]);
+            if (hakit_chart_add(chart_name, signal_name, chart_args[1])) {
+                hakit_chart_changed = true;
+            }
         }
     }
 }
@@ -125,6 +131,22 @@ function hakit_recv_trace(line)
     var fields = line.split(" ");
     var name = fields[0];
 
+    /* Incremental trace: append points following cursor */
+    if (name.substr(0,1) == '+') {
+        name = name.substr(1);
+        for (var i = 1; i < fields.length; i++) {
+            var tab = fields[i].split(",");
+            var pt = {
+                t: parseInt(tab[0]) + hakit_t0,
+                y: tab[1],
+            }
+            if ((typeof hakit_chart_enabled === "function") && hakit_chart_enabled()) {
+                hakit_chart_updated(name, pt);
+            }
+        }
+        return;
+    }
+
     var data = [];
     for (var i = 1; i < fields.length; i++) {
         var tab = fields[i].split(",");
@@ -148,13 +170,23 @@ function hakit_recv_event(line)
         var tab = line.substr(1,i-1).split(',');
         var signal_spec = tab.pop();
         var t = tab.pop();
+        var seq = tab.pop();
 	var value = line.substr(i+1);
 	hakit_updated(signal_spec, value);
 
+        /* Points recorded before trace dump are part of it */
+        if (hakit_sock_state != HAKIT_ST_READY) {
+            return;
+        }
+
+        if (seq) {
+            hakit_trace_seq = Math.max(hakit_trace_seq, parseInt(seq));
+        }
+
         if ((typeof hakit_chart_enabled === "function") && hakit_chart_enabled()) {
             if (t) {
                 var pt = {
-                    t: parseInt(t) + hakit_t0,
+                    t: parseFloat(t) + hakit_t0,
                     y: value,
                 }
 	        hakit_chart_updated(signal_spec, pt);
@@ -164,6 +196,35 @@ function hakit_recv_event(line)
 }
 
 
+function hakit_trace_request(resume)
+{
+    var depth = undefined;
+    if (hakit_props['TRACE_DEPTH']) {
+        depth = parseInt(hakit_props['TRACE_DEPTH']);
+    }
+
+    /* Resume charts from trace cursor after reconnect,
+       otherwise (re)build them from a full trace dump */
+    var cursor = "@";
+    if (resume) {
+        cursor += hakit_trace_epoch+"."+hakit_trace_seq;
+    }
+    else {
+        hakit_chart_init(depth);
+    }
+
+    var points = hakit_chart_points();
+    if (points > 0) {
+        hakit_send("trace /"+points+" "+cursor);
+    }
+    else {
+        hakit_send("trace "+cursor);
+    }
+
+    hakit_sock_state = HAKIT_ST_TRACE;
+}
+
+
 function hakit_recv_line(line)
 {
     //console.log("hakit_recv_line('"+line+"')");
@@ -175,23 +236,25 @@ function hakit_recv_line(line)
 	if (line == ".") {
 	    if (hakit_sock_state == HAKIT_ST_PROPS) {
 		hakit_connected(true);
+		hakit_chart_changed = false;
 		hakit_send("get");
 		hakit_sock_state = HAKIT_ST_GET;
 	    }
 	    else if (hakit_sock_state == HAKIT_ST_GET) {
                 if ((typeof hakit_chart_enabled === "function") && hakit_chart_enabled()) {
-                    var depth = undefined;
-                    if (hakit_props['TRACE_DEPTH']) {
-                        depth = parseInt(hakit_props['TRACE_DEPTH']);
-                    }
-                    hakit_chart_init(depth);
-		    hakit_send("trace");
-		    hakit_sock_state = HAKIT_ST_TRACE;
+                    /* Charts need to be rebuilt if new signals showed up */
+                    hakit_trace_request(hakit_trace_epoch && !hakit_chart_changed);
+                    hakit_chart_changed = false;
                 }
                 else {
 		    hakit_sock_state = HAKIT_ST_READY;
                 }
 	    }
+	    else if ((hakit_sock_state == HAKIT_ST_TRACE) && hakit_trace_restarted) {
+                /* Engine was restarted: rebuild charts from scratch */
+                hakit_trace_restarted = false;
+                hakit_trace_request(false);
+	    }
 	    else {
 		hakit_sock_state = HAKIT_ST_READY;
             }
@@ -204,7 +267,17 @@ function hakit_recv_line(line)
                 hakit_recv_get(line);
 	    }
 	    else if (hakit_sock_state == HAKIT_ST_TRACE) {
-                hakit_recv_trace(line);
+                if (line.substr(0,1) == "@") {
+                    var cursor = line.substr(1).split(".");
+                    if (hakit_trace_epoch && (cursor[0] != hakit_trace_epoch)) {
+                        hakit_trace_restarted = true;
+                    }
+                    hakit_trace_epoch = cursor[0];
+                    hakit_trace_seq = parseInt(cursor[1]);
+                }
+                else {
+                    hakit_recv_trace(line);
+                }
             }
 	}
     }
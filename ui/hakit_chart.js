@@ -30,6 +30,13 @@ function hakit_chart_enabled()
 }
 
 
+function hakit_chart_points()
+{
+    /* No need to retrieve more points than the chart can show */
+    return hakit_chart.container ? hakit_chart.container.clientWidth : 0;
+}
+
+
 function hakit_chart_clear()
 {
     console.log("hakit_chart_clear()");
@@ -161,6 +168,11 @@ function hakit_chart_init(depth)
             }
         }
 
+        // Drop previous chart when rebuilding
+        if (chart.chart) {
+            chart.chart.destroy();
+        }
+
         var ctx = canvas.getContext('2d');
         chart.chart = new Chart(ctx, chart.config);
     }
@@ -197,7 +209,7 @@ function hakit_chart_add(chart_spec, signal_spec, signal_color)
     // Ignore signal if it already has a chart
     for (var i = 0; i < chart.signals.length; i++) {
         if (chart.signals[i].name == signal_name) {
-            return;
+            return false;
         }
     }
 
@@ -212,6 +224,8 @@ function hakit_chart_add(chart_spec, signal_spec, signal_color)
         signal.color = signal_color;
     }
     chart.signals.push(signal);
+
+    return true;
 }
 
 